@@ -0,0 +1,116 @@
+#ifndef CORRELATIONTABLE_H
+#define CORRELATIONTABLE_H
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+// Pre-allocated ring of correlation slots used to match responses to waiting callers.
+// A message id maps to slot (msg_id & mask); the remaining upper bits of the id act
+// as the slot's generation, so a late response to a query that was cancelled (timed out)
+// no longer matches the slot's current id and is detected and dropped.
+// Each slot has a single atomic tag word holding (msg_id << 2 | state), and ownership
+// of the payload is always transferred with a CAS on that tag, so Register, Complete
+// and Cancel are safe to call concurrently from any thread, and all are O(1).
+// The number of slots is rounded up to the next power of two, and bounds the number
+// of queries that can be awaiting a response at once.
+template <typename T>
+class CorrelationTable {
+	public:
+	explicit CorrelationTable(size_t n_slots_in){
+		n_slots = 2;
+		while(n_slots < n_slots_in) n_slots <<= 1;
+		mask = n_slots - 1;
+		slots.reset(new Slot[n_slots]);
+		for(size_t i=0; i<n_slots; ++i) slots[i].tag.store(FREE, std::memory_order_relaxed);
+		next_id.store(1, std::memory_order_relaxed);
+		in_flight.store(0, std::memory_order_relaxed);
+	}
+
+	// store payload in a free slot and return the message id that refers to it.
+	// returns false if no free slot could be found (too many queries in flight).
+	bool Register(T&& payload, uint32_t& msg_id){
+		// a slot may still be held by an older generation that hasn't completed;
+		// in that case just move on to the next id.
+		for(int attempt=0; attempt<max_attempts; ++attempt){
+			uint32_t id = next_id.fetch_add(1, std::memory_order_relaxed);
+			Slot& slot = slots[id & mask];
+			uint64_t tag = slot.tag.load(std::memory_order_acquire);
+			if((tag & STATE_MASK) != FREE) continue;
+			if(not slot.tag.compare_exchange_strong(tag, MakeTag(id, BUSY), std::memory_order_acquire)){
+				continue;
+			}
+			slot.payload = std::move(payload);
+			slot.tag.store(MakeTag(id, PENDING), std::memory_order_release);
+			in_flight.fetch_add(1, std::memory_order_relaxed);
+			msg_id = id;
+			return true;
+		}
+		return false;
+	}
+
+	// retrieve and release the payload for msg_id.
+	// returns false if msg_id is stale or unknown (already completed or cancelled),
+	// in which case the payload is left untouched.
+	bool Complete(uint32_t msg_id, T& payload){
+		Slot& slot = slots[msg_id & mask];
+		uint64_t expected = MakeTag(msg_id, PENDING);
+		if(not slot.tag.compare_exchange_strong(expected, MakeTag(msg_id, BUSY), std::memory_order_acquire)){
+			return false;
+		}
+		payload = std::move(slot.payload);
+		slot.payload = T();
+		slot.tag.store(MakeTag(msg_id, FREE), std::memory_order_release);
+		in_flight.fetch_sub(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// abandon msg_id (e.g. on timeout). Exactly one of Complete or Cancel will succeed
+	// for any registered id; if Cancel returns false the response won the race.
+	bool Cancel(uint32_t msg_id, T& payload){
+		return Complete(msg_id, payload);
+	}
+
+	// access the payload for a pending msg_id without releasing it; nullptr if stale or unknown.
+	// Only safe on the thread that performs Complete/Cancel (the PGClient background thread),
+	// since the pointer is invalidated when the id completes.
+	T* Find(uint32_t msg_id){
+		Slot& slot = slots[msg_id & mask];
+		if(slot.tag.load(std::memory_order_acquire) != MakeTag(msg_id, PENDING)) return nullptr;
+		return &slot.payload;
+	}
+
+	// number of registered ids awaiting completion
+	size_t InFlight() const { return in_flight.load(std::memory_order_relaxed); }
+	size_t Slots() const { return n_slots; }
+
+	private:
+	static const uint64_t FREE = 0;
+	static const uint64_t BUSY = 1;      // payload being written or taken
+	static const uint64_t PENDING = 2;   // registered, awaiting completion
+	static const uint64_t STATE_MASK = 3;
+	static const int max_attempts = 64;
+
+	static uint64_t MakeTag(uint32_t id, uint64_t state){ return ((uint64_t)id << 2) | state; }
+
+	struct Slot {
+		std::atomic<uint64_t> tag;
+		T payload;
+	};
+
+	std::unique_ptr<Slot[]> slots;
+	size_t n_slots;
+	size_t mask;
+	// keep the contended counters on separate cache lines
+	char pad0[64];
+	std::atomic<uint32_t> next_id;
+	char pad1[64];
+	std::atomic<size_t> in_flight;
+	char pad2[64];
+
+	CorrelationTable(const CorrelationTable&) = delete;
+	CorrelationTable& operator=(const CorrelationTable&) = delete;
+};
+
+#endif
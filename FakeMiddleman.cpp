@@ -0,0 +1,442 @@
+#include "FakeMiddleman.h"
+#include "FrameCompression.h"
+#include <cstring>
+#include <tuple>
+#include <iostream>
+
+FakeMiddleman::FakeMiddleman(zmq::context_t* context_in, std::string client_address_in, int clt_dlr_port_in, int clt_pub_port_in) :
+	context(context_in), client_address(client_address_in), clt_dlr_port(clt_dlr_port_in), clt_pub_port(clt_pub_port_in){
+	running = false;
+	queries_answered = 0;
+	writes_received = 0;
+	write_messages_received = 0;
+	prepared_executions = 0;
+	duplicate_writes = 0;
+	rng.seed(std::random_device()());
+	SetRows(1, 16);
+}
+
+FakeMiddleman::~FakeMiddleman(){
+	Stop();
+}
+
+void FakeMiddleman::SetRows(int rows_in, int row_size_in){
+	// only call while stopped
+	rows = rows_in;
+	row_data.clear();
+	for(int i=0; i<rows; ++i){
+		std::string row = std::to_string(i)+",";
+		row.resize(row_size_in, 'x');
+		row_data.push_back(row);
+	}
+}
+
+void FakeMiddleman::SetLatency(int latency_us){
+	// only call while stopped
+	latency = std::chrono::microseconds(latency_us);
+}
+
+void FakeMiddleman::SetSlowFraction(double slow_fraction_in, int delay_ms){
+	// only call while stopped
+	slow_fraction = slow_fraction_in;
+	slow_delay = std::chrono::milliseconds(delay_ms);
+}
+
+void FakeMiddleman::SetDropRate(double drop_rate_in){
+	// only call while stopped
+	drop_rate = drop_rate_in;
+}
+
+void FakeMiddleman::SetMaster(int master_port_in){
+	// only call while stopped
+	master_port = master_port_in;
+}
+
+void FakeMiddleman::SetWriteTopics(bool write_topics_in){
+	// only call while stopped
+	write_topics = write_topics_in;
+}
+
+void FakeMiddleman::Subscribe(const std::string& topic){
+	// only call while stopped
+	topics.push_back(topic);
+}
+
+void FakeMiddleman::SetCompression(size_t threshold_in){
+	// only call while stopped
+	compress_threshold = threshold_in;
+}
+
+bool FakeMiddleman::Start(){
+	if(running) return false;
+	
+	// the real middleman connects to the clients it discovers, so do the same.
+	rtr_socket = new zmq::socket_t(*context, ZMQ_ROUTER);
+	// a router drops replies beyond its high water mark, so don't limit it
+	rtr_socket->setsockopt(ZMQ_SNDHWM, 0);
+	// don't hold up shutdown with responses for a client that has gone
+	int linger = 0;
+	rtr_socket->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+	// announce ourselves on connecting, for clients that route reads themselves
+	int probe = 1;
+	rtr_socket->setsockopt(ZMQ_PROBE_ROUTER, &probe, sizeof(probe));
+	rtr_socket->connect("tcp://"+client_address+":"+std::to_string(clt_dlr_port));
+	sub_socket = new zmq::socket_t(*context, ZMQ_SUB);
+	if(topics.empty()) sub_socket->setsockopt(ZMQ_SUBSCRIBE, "", 0);
+	for(const std::string& topic : topics) sub_socket->setsockopt(ZMQ_SUBSCRIBE, topic.data(), topic.size());
+	sub_socket->connect("tcp://"+client_address+":"+std::to_string(clt_pub_port));
+	if(master_port!=0){
+		// the master takes writes sent to it directly, as well as those published
+		pull_socket = new zmq::socket_t(*context, ZMQ_PULL);
+		pull_socket->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+		pull_socket->bind("tcp://*:"+std::to_string(master_port));
+	}
+	
+	running = true;
+	thread = std::thread(&FakeMiddleman::Run, this);
+	return true;
+}
+
+bool FakeMiddleman::Stop(){
+	if(not running) return false;
+	running = false;
+	thread.join();
+	streams.clear();
+	delayed.clear();
+	delete rtr_socket; rtr_socket=nullptr;
+	delete sub_socket; sub_socket=nullptr;
+	delete pull_socket; pull_socket=nullptr;
+	return true;
+}
+
+void FakeMiddleman::Run(){
+	
+	std::vector<zmq::pollitem_t> in_polls{zmq::pollitem_t{*rtr_socket,0,ZMQ_POLLIN,0},
+	                                      zmq::pollitem_t{*sub_socket,0,ZMQ_POLLIN,0}};
+	if(pull_socket) in_polls.push_back(zmq::pollitem_t{*pull_socket,0,ZMQ_POLLIN,0});
+	
+	while(running){
+		// short timeout so we notice when we're stopped
+		zmq::poll(in_polls.data(), in_polls.size(), PollTimeout());
+		if(in_polls.at(0).revents & ZMQ_POLLIN){
+			// drain everything available, the same as the client does
+			while(HandleReadQuery()){}
+		}
+		if(in_polls.at(1).revents & ZMQ_POLLIN){
+			while(HandleWriteQuery(sub_socket)){}
+		}
+		if(pull_socket && (in_polls.at(2).revents & ZMQ_POLLIN)){
+			while(HandleWriteQuery(pull_socket)){}
+		}
+		SendChunks();
+		SendDelayed();
+	}
+}
+
+int FakeMiddleman::PollTimeout(){
+	// short timeout so we notice when we're stopped, and shorter to send held back responses on time.
+	// Those due within the millisecond are waited for by spinning.
+	if(delayed.empty()) return 50;
+	long ms = std::chrono::duration_cast<std::chrono::milliseconds>(delayed.begin()->first-std::chrono::steady_clock::now()).count();
+	return (ms<0) ? 0 : (ms>50) ? 50 : ms;
+}
+
+void FakeMiddleman::SendDelayed(){
+	// send the held back responses that are due, earliest first
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	while(not delayed.empty() && delayed.begin()->first<=now){
+		Delayed& response = delayed.begin()->second;
+		SendResponse(response.client, response.msg_id, 1, 0, rows, response.compress);
+		delayed.erase(delayed.begin());
+	}
+}
+
+bool FakeMiddleman::HandleReadQuery(){
+	// read queries arrive as: [client ID][message ID][database name][SQL statement]
+	std::vector<zmq::message_t> parts;
+	zmq::message_t tmp;
+	while(rtr_socket->recv(&tmp, (parts.empty()) ? ZMQ_DONTWAIT : 0)){
+		parts.resize(parts.size()+1);
+		parts.back().move(&tmp);
+		if(not parts.back().more()) break;
+	}
+	if(parts.size()<2) return false;
+	Decompress(parts);
+	
+	// flow control for a streaming read: [client ID][message ID][chunks]
+	if(parts.size()==3) return HandleCredit(parts);
+	if(Drop()) return true;
+	bool compress = parts.size()>=3 && (RequestFlags(parts.at(2)) & REQ_ACCEPT_COMPRESSED);
+	
+	// streaming reads carry a trailing [StreamRequest]; the rows are sent by SendChunks
+	if(parts.size()>=5 && not IsExecution(parts.at(3)) && parts.at(4).size()==sizeof(StreamRequest)){
+		StreamRequest request;
+		memcpy(&request, parts.at(4).data(), sizeof(request));
+		uint32_t id;
+		memcpy(&id, parts.at(1).data(), sizeof(id));
+		Stream& stream = streams[std::make_pair(std::string(static_cast<char*>(parts.at(0).data()), parts.at(0).size()), id)];
+		stream.client.move(&parts.at(0));
+		stream.msg_id.move(&parts.at(1));
+		stream.next_row = 0;
+		stream.chunk_rows = (request.chunk_rows>0) ? request.chunk_rows : 1;
+		stream.credits = request.window;
+		stream.compress = compress;
+		return true;
+	}
+	
+	// prepared statement executions need the statement to have been prepared
+	if(not KnowsStatement(parts, 3)){
+		SendResponse(parts.at(0), parts.at(1), RESP_UNKNOWN_STATEMENT, 0, 0);
+		return true;
+	}
+	
+	// an empty statement fails, as it would in the database
+	if(parts.size()<4 || (not IsExecution(parts.at(3)) && strnlen(static_cast<char*>(parts.at(3).data()), parts.at(3).size())==0)){
+		SendResponse(parts.at(0), parts.at(1), 0, 0, 0);
+		++queries_answered;
+		return true;
+	}
+	
+	// batched lookups get each row for each key, tagged with the key
+	if(parts.size()>=4 && not IsExecution(parts.at(3)) && SendLookupResponse(parts, compress)){
+		++queries_answered;
+		return true;
+	}
+	
+	// responses are held back for as long as the database would take, and some longer, as if it were slow
+	std::chrono::steady_clock::duration delay = latency;
+	if(slow_fraction>0 && std::uniform_real_distribution<double>(0, 1)(rng) < slow_fraction) delay += slow_delay;
+	if(delay.count()>0){
+		Delayed& response = delayed.emplace(std::piecewise_construct,
+		                                    std::forward_as_tuple(std::chrono::steady_clock::now()+delay),
+		                                    std::forward_as_tuple())->second;
+		response.client.move(&parts.at(0));
+		response.msg_id.move(&parts.at(1));
+		response.compress = compress;
+		++queries_answered;
+		return true;
+	}
+	
+	// respond with: [client ID][message ID][status][rows...]
+	SendResponse(parts.at(0), parts.at(1), 1, 0, rows, compress);
+	
+	++queries_answered;
+	return true;
+}
+
+bool FakeMiddleman::SendLookupResponse(std::vector<zmq::message_t>& parts, bool compress){
+	// a query ending "= ANY('{"k1","k2"...}')" is answered with rows of "<key length>:<key><row>",
+	// as PGClient's lookups select them.
+	// Returns false for any other query.
+	std::string sql(static_cast<char*>(parts.at(3).data()), strnlen(static_cast<char*>(parts.at(3).data()), parts.at(3).size()));
+	size_t start = sql.find("= ANY('{");
+	if(start==std::string::npos) return false;
+	start += 8;
+	size_t end = sql.rfind("}')");
+	if(end==std::string::npos) return false;
+	// keys are quoted, with backslash escapes, and single quotes doubled
+	std::vector<std::string> keys;
+	bool quoted = false;
+	for(size_t pos=start; pos<end; ++pos){
+		char c = sql[pos];
+		if(not quoted && c==',') continue;
+		if(c=='"'){
+			quoted = not quoted;
+			if(quoted) keys.emplace_back();
+			continue;
+		}
+		if(c=='\\' || (c=='\'' && sql[pos+1]=='\'')) c = sql[++pos];
+		if(not keys.empty()) keys.back() += c;
+	}
+	
+	zmq::message_t client_msg;
+	client_msg.copy(&parts.at(0));
+	rtr_socket->send(client_msg, ZMQ_SNDMORE);
+	zmq::message_t id_msg;
+	id_msg.copy(&parts.at(1));
+	rtr_socket->send(id_msg, ZMQ_SNDMORE);
+	int status = (compress) ? 1 | RESP_ACCEPTS_COMPRESSED : 1;
+	zmq::message_t status_msg(sizeof(status));
+	memcpy(status_msg.data(), &status, sizeof(status));
+	rtr_socket->send(status_msg, (keys.size()*rows>0) ? ZMQ_SNDMORE : 0);
+	for(size_t k=0; k<keys.size(); ++k){
+		for(int i=0; i<rows; ++i){
+			SendRow(std::to_string(keys.at(k).size())+':'+keys.at(k)+row_data.at(i), compress, (k+1<keys.size() || i+1<rows) ? ZMQ_SNDMORE : 0);
+		}
+	}
+	return true;
+}
+
+bool FakeMiddleman::IsExecution(zmq::message_t& part){
+	// whether a query part is an ExecuteHeader rather than SQL
+	return part.size()==sizeof(ExecuteHeader) && memcmp(part.data(), EXECUTE_MARKER, sizeof(EXECUTE_MARKER))==0;
+}
+
+bool FakeMiddleman::KnowsStatement(std::vector<zmq::message_t>& parts, size_t query_part){
+	// true unless parts are an execution of a prepared statement that we haven't been given the SQL for:
+	// [...][ExecuteHeader][parameters]([SQL statement])
+	if(parts.size()<=query_part || not IsExecution(parts.at(query_part))) return true;
+	ExecuteHeader header;
+	memcpy(&header, parts.at(query_part).data(), sizeof(header));
+	++prepared_executions;
+	std::pair<std::string,uint32_t> key(std::string(static_cast<char*>(parts.at(0).data()), parts.at(0).size()), header.statement_id);
+	if(parts.size()>query_part+2){
+		// includes the SQL; prepare it
+		prepared.insert(key);
+		return true;
+	}
+	return prepared.count(key)>0;
+}
+
+bool FakeMiddleman::HandleCredit(std::vector<zmq::message_t>& parts){
+	uint32_t id, chunks;
+	memcpy(&id, parts.at(1).data(), sizeof(id));
+	memcpy(&chunks, parts.at(2).data(), sizeof(chunks));
+	auto it = streams.find(std::make_pair(std::string(static_cast<char*>(parts.at(0).data()), parts.at(0).size()), id));
+	if(it==streams.end()) return true;
+	if(chunks==0) streams.erase(it);   // cancelled
+	else it->second.credits += chunks;
+	return true;
+}
+
+void FakeMiddleman::SendChunks(){
+	// send the next chunk of each stream the client has room for
+	for(auto it=streams.begin(); it!=streams.end(); ){
+		Stream& stream = it->second;
+		while(stream.credits>0 && stream.next_row+stream.chunk_rows<rows){
+			SendResponse(stream.client, stream.msg_id, 1 | RESP_MORE, stream.next_row, stream.chunk_rows, stream.compress);
+			stream.next_row += stream.chunk_rows;
+			--stream.credits;
+		}
+		if(stream.credits>0){
+			// final chunk
+			SendResponse(stream.client, stream.msg_id, 1, stream.next_row, rows-stream.next_row, stream.compress);
+			++queries_answered;
+			it = streams.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+void FakeMiddleman::SendResponse(zmq::message_t& client, zmq::message_t& msg_id, int status, int first_row, int n_rows, bool compress){
+	// [client ID][message ID][status][rows...]
+	if(compress) status |= RESP_ACCEPTS_COMPRESSED;
+	zmq::message_t client_msg;
+	client_msg.copy(&client);
+	rtr_socket->send(client_msg, ZMQ_SNDMORE);
+	zmq::message_t id_msg;
+	id_msg.copy(&msg_id);
+	rtr_socket->send(id_msg, ZMQ_SNDMORE);
+	zmq::message_t status_msg(sizeof(status));
+	memcpy(status_msg.data(), &status, sizeof(status));
+	rtr_socket->send(status_msg, (n_rows>0) ? ZMQ_SNDMORE : 0);
+	for(int i=first_row; i<first_row+n_rows; ++i){
+		SendRow(row_data.at(i), compress, (i<(first_row+n_rows-1)) ? ZMQ_SNDMORE : 0);
+	}
+}
+
+void FakeMiddleman::SendRow(const std::string& row_text, bool compress, int flags){
+	// one row, with its terminating null; compressed if it's large and the client accepts that
+	std::string compressed;
+	if(compress && compress_threshold>0 && row_text.size()+1>=compress_threshold &&
+	   FrameCompression::Compress(row_text.c_str(), row_text.size()+1, compressed, 1)){
+		zmq::message_t row(compressed.size());
+		memcpy(row.data(), compressed.data(), compressed.size());
+		rtr_socket->send(row, flags);
+		return;
+	}
+	zmq::message_t row(row_text.size()+1);
+	memcpy(row.data(), row_text.c_str(), row_text.size()+1);
+	rtr_socket->send(row, flags);
+}
+
+void FakeMiddleman::Decompress(std::vector<zmq::message_t>& parts){
+	for(zmq::message_t& part : parts){
+		if(FrameCompression::IsCompressed(part) && not FrameCompression::Decompress(part)){
+			std::cerr<<"FakeMiddleman: corrupt compressed frame"<<std::endl;
+		}
+	}
+}
+
+uint32_t FakeMiddleman::RequestFlags(zmq::message_t& dbname){
+	// request flags follow the database name's terminating null
+	const char* data = static_cast<const char*>(dbname.data());
+	size_t name_end = strnlen(data, dbname.size())+1;
+	uint32_t flags = 0;
+	if(dbname.size()>=name_end+sizeof(flags)) memcpy(&flags, data+name_end, sizeof(flags));
+	return flags;
+}
+
+bool FakeMiddleman::Drop(){
+	// whether to lose this query, as if the network had
+	if(drop_rate<=0) return false;
+	return std::uniform_real_distribution<double>(0, 1)(rng) < drop_rate;
+}
+
+bool FakeMiddleman::AlreadyApplied(std::vector<zmq::message_t>& parts){
+	// remember the writes we've applied by client and message id, so resends aren't applied twice
+	uint32_t id;
+	memcpy(&id, parts.at(1).data(), sizeof(id));
+	std::pair<std::string,uint32_t> key(std::string(static_cast<char*>(parts.at(0).data()), parts.at(0).size()), id);
+	if((RequestFlags(parts.at(2)) & REQ_RESEND) && applied.count(key)) return true;
+	if(applied.insert(key).second){
+		applied_order.push_back(key);
+		if(applied_order.size()>100000){
+			applied.erase(applied_order.front());
+			applied_order.pop_front();
+		}
+	}
+	return false;
+}
+
+bool FakeMiddleman::HandleWriteQuery(zmq::socket_t* socket){
+	// write queries arrive as: [client ID][message ID][database name][SQL statement]...
+	// they're discarded, and acknowledged as successful.
+	std::vector<zmq::message_t> parts;
+	zmq::message_t tmp;
+	while(socket->recv(&tmp, (parts.empty()) ? ZMQ_DONTWAIT : 0)){
+		parts.resize(parts.size()+1);
+		parts.back().move(&tmp);
+		if(not parts.back().more()) break;
+	}
+	if(parts.empty()) return false;
+	// the topic is only there for subscribing, so drop it; whether there is one depends on the
+	// client's settings, not on what we subscribed to
+	if(write_topics) parts.erase(parts.begin());
+	Decompress(parts);
+	if(Drop()) return true;
+	++write_messages_received;
+	if(parts.size()<4) return true;
+	if(AlreadyApplied(parts)){
+		++duplicate_writes;
+		SendResponse(parts.at(0), parts.at(1), 1, 0, 0);
+		return true;
+	}
+	if(not KnowsStatement(parts, 3)){
+		SendResponse(parts.at(0), parts.at(1), RESP_UNKNOWN_STATEMENT, 0, 0);
+		return true;
+	}
+	if(IsExecution(parts.at(3))){
+		// an execution of a prepared statement is a single write
+		++writes_received;
+		SendResponse(parts.at(0), parts.at(1), 1, 0, 0);
+		return true;
+	}
+	
+	// acknowledge with: [client ID][message ID][status], plus an empty row per statement for batches
+	int n_statements = parts.size()-3;
+	writes_received += n_statements;
+	if(Drop()) return true;   // the acknowledgement is lost
+	rtr_socket->send(parts.at(0), ZMQ_SNDMORE);
+	rtr_socket->send(parts.at(1), ZMQ_SNDMORE);
+	int status = 1;
+	zmq::message_t status_msg(sizeof(status));
+	memcpy(status_msg.data(), &status, sizeof(status));
+	rtr_socket->send(status_msg, (n_statements>1) ? ZMQ_SNDMORE : 0);
+	for(int i=0; n_statements>1 && i<n_statements; ++i){
+		zmq::message_t ack(0);
+		rtr_socket->send(ack, (i<n_statements-1) ? ZMQ_SNDMORE : 0);
+	}
+	return true;
+}
@@ -0,0 +1,122 @@
+#ifndef FAKEMIDDLEMAN_H
+#define FAKEMIDDLEMAN_H
+
+#include "zmq.hpp"
+#include "Protocol.h"
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <map>
+#include <set>
+#include <deque>
+#include <random>
+#include <chrono>
+
+// A local stand-in for the middleman, for benchmarking PGClient without
+// a network, a real middleman, or PostgreSQL.
+// It connects a ROUTER socket to the client's read port and a SUB socket to
+// its write port, just as the middleman does, and answers every read query
+// with a successful response of a fixed number of rows. Writes are acknowledged as successful.
+// Streaming reads are answered in chunks, honouring the client's flow control.
+// Batched lookups are answered with the rows for each key, tagged with the key.
+// Compressed frames are accepted, and large rows compressed if the client accepts that.
+// A fraction of queries may be dropped unanswered, to exercise resends; resent writes
+// that were already applied are acknowledged but not counted again.
+// Reads may be answered after a fixed latency, as if the database took that long,
+// and a fraction of them later still, as if it were sometimes slow.
+// As the master, it also accepts writes sent to it directly (leader_writes) on a port of its own.
+class FakeMiddleman {
+	public:
+	FakeMiddleman(zmq::context_t* context_in, std::string client_address_in, int clt_dlr_port_in, int clt_pub_port_in);
+	~FakeMiddleman();
+	bool Start();
+	bool Stop();
+	
+	void SetRows(int rows_in, int row_size_in);   // rows returned for each read query, and bytes per row
+	void SetCompression(size_t threshold_in);     // compress rows this size or larger, for clients that accept it
+	void SetDropRate(double drop_rate_in);        // fraction of queries to ignore, as if lost
+	void SetLatency(int latency_us);              // time taken to answer each read (not streamed or lookups)
+	void SetSlowFraction(double slow_fraction_in, int delay_ms);   // fraction of reads answered after a further delay
+	void SetMaster(int master_port_in);           // accept writes sent directly on this port (0: not master)
+	void SetWriteTopics(bool write_topics_in);    // writes start with a topic frame (the client has write_topics set)
+	void Subscribe(const std::string& topic);     // only take writes with this topic (needs SetWriteTopics)
+	long QueriesAnswered(){ return queries_answered.load(); }
+	long WritesReceived(){ return writes_received.load(); }              // write statements
+	long WriteMessagesReceived(){ return write_messages_received.load(); }
+	long PreparedExecutions(){ return prepared_executions.load(); }
+	long DuplicateWrites(){ return duplicate_writes.load(); }         // resent writes not applied again
+	
+	private:
+	void Run();
+	bool HandleReadQuery();
+	bool HandleWriteQuery(zmq::socket_t* socket);
+	bool HandleCredit(std::vector<zmq::message_t>& parts);
+	bool KnowsStatement(std::vector<zmq::message_t>& parts, size_t query_part);
+	static bool IsExecution(zmq::message_t& part);
+	void SendChunks();
+	void SendDelayed();
+	int PollTimeout();
+	void SendResponse(zmq::message_t& client, zmq::message_t& msg_id, int status, int first_row, int n_rows, bool compress=false);
+	bool SendLookupResponse(std::vector<zmq::message_t>& parts, bool compress);
+	void SendRow(const std::string& row_text, bool compress, int flags);
+	void Decompress(std::vector<zmq::message_t>& parts);
+	static uint32_t RequestFlags(zmq::message_t& dbname);
+	bool Drop();
+	bool AlreadyApplied(std::vector<zmq::message_t>& parts);
+	
+	// streaming reads in progress, by client ID and message ID
+	struct Stream {
+		zmq::message_t client;
+		zmq::message_t msg_id;
+		int next_row;
+		int chunk_rows;
+		long credits;
+		bool compress;
+	};
+	std::map<std::pair<std::string,uint32_t>, Stream> streams;
+	// prepared statements, by client ID and statement ID
+	std::set<std::pair<std::string,uint32_t>> prepared;
+	// recently applied writes, by client ID and message ID, oldest first
+	std::set<std::pair<std::string,uint32_t>> applied;
+	std::deque<std::pair<std::string,uint32_t>> applied_order;
+	
+	zmq::context_t* context = nullptr;
+	std::string client_address;
+	int clt_dlr_port;
+	int clt_pub_port;
+	int master_port = 0;
+	bool write_topics = false;
+	std::vector<std::string> topics;
+	
+	int rows = 1;
+	size_t compress_threshold = 0;
+	double drop_rate = 0;
+	double slow_fraction = 0;
+	std::chrono::milliseconds slow_delay{0};
+	std::chrono::microseconds latency{0};
+	// responses being held back, by when they're due
+	struct Delayed {
+		zmq::message_t client;
+		zmq::message_t msg_id;
+		bool compress;
+	};
+	std::multimap<std::chrono::steady_clock::time_point, Delayed> delayed;
+	std::mt19937 rng;
+	std::vector<std::string> row_data;
+	
+	std::thread thread;
+	std::atomic<bool> running;
+	std::atomic<long> queries_answered;
+	std::atomic<long> writes_received;
+	std::atomic<long> write_messages_received;
+	std::atomic<long> prepared_executions;
+	std::atomic<long> duplicate_writes;
+	
+	zmq::socket_t* rtr_socket = nullptr;
+	zmq::socket_t* sub_socket = nullptr;
+	zmq::socket_t* pull_socket = nullptr;
+};
+
+#endif
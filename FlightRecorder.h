@@ -0,0 +1,97 @@
+#ifndef FLIGHTRECORDER_H
+#define FLIGHTRECORDER_H
+
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <algorithm>
+
+// Fixed-size ring buffer of the most recent completed queries and when they reached each stage,
+// so that when something goes wrong (e.g. a timeout) the queries leading up to it can be looked at.
+// Entries are plain fixed-size structs, overwritten oldest first, so recording is a copy and never
+// allocates. There is one writer (the background thread); other threads may Dump at any time.
+// Each slot has a sequence number, odd while it's being written, so readers skip entries
+// that are overwritten as they copy them rather than taking a lock.
+class FlightRecorder {
+	public:
+	typedef std::chrono::steady_clock::time_point time_point;
+
+	struct Entry {
+		uint32_t msg_id;             // shared by queries batched into one message
+		char type;
+		bool success;
+		bool timed_out;
+		uint8_t retries;
+		int16_t peer;                // the middleman a read was sent to, with read_routing (-1 otherwise)
+		uint32_t statement_id;
+		char dbname[24];             // truncated
+		char query[64];              // the start of the SQL, truncated
+		time_point submitted;
+		time_point dequeued;         // taken from the queue by the background thread
+		time_point sent;
+		time_point received;         // its response
+		time_point delivered;        // handed back to the client
+	};
+
+	explicit FlightRecorder(size_t size_in) : slots(size_in ? size_in : 1) {
+		for(Slot& slot : slots) slot.seq.store(0, std::memory_order_relaxed);
+	}
+
+	// writer only
+	Entry& Next(){
+		Slot& slot = slots[next % slots.size()];
+		slot.seq.store(2*next+1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		return slot.entry;
+	}
+	void Commit(){
+		Slot& slot = slots[next % slots.size()];
+		++next;
+		slot.seq.store(2*next, std::memory_order_release);
+	}
+
+	// the entries still held, oldest first
+	std::vector<Entry> Dump() const {
+		std::vector<std::pair<uint64_t, Entry>> held;
+		held.reserve(slots.size());
+		for(const Slot& slot : slots){
+			uint64_t before = slot.seq.load(std::memory_order_acquire);
+			if(before==0 || (before&1)) continue;
+			held.emplace_back();
+			memcpy(&held.back().second, &slot.entry, sizeof(Entry));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if(slot.seq.load(std::memory_order_relaxed)!=before) held.pop_back();
+			else held.back().first = before;
+		}
+		std::sort(held.begin(), held.end(), [](const std::pair<uint64_t, Entry>& a, const std::pair<uint64_t, Entry>& b){ return a.first<b.first; });
+		std::vector<Entry> entries;
+		entries.reserve(held.size());
+		for(std::pair<uint64_t, Entry>& entry : held) entries.push_back(entry.second);
+		return entries;
+	}
+
+	// copy a string into a fixed-size field, truncated and null-terminated
+	template<size_t N> static void Copy(char (&field)[N], const std::string& from){
+		size_t length = (from.size()<N) ? from.size() : N-1;
+		memcpy(field, from.data(), length);
+		field[length] = '\0';
+	}
+
+	private:
+	struct Slot {
+		std::atomic<uint64_t> seq;
+		Entry entry;
+	};
+	std::vector<Slot> slots;
+	uint64_t next = 0;
+
+	FlightRecorder(const FlightRecorder&) = delete;
+	FlightRecorder& operator=(const FlightRecorder&) = delete;
+};
+
+#endif
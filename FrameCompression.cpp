@@ -0,0 +1,41 @@
+#include "FrameCompression.h"
+#include <zlib.h>
+#include <cstring>
+#include <cstdint>
+
+bool FrameCompression::Compress(const char* data, size_t size, std::string& out, int level){
+	if(size>UINT32_MAX) return false;
+	uLongf compressed_size = compressBound(size);
+	out.resize(sizeof(CompressedHeader)+compressed_size);
+	CompressedHeader header;
+	memcpy(header.marker, COMPRESSED_MARKER, sizeof(header.marker));
+	header.raw_size = size;
+	memcpy(&out[0], &header, sizeof(header));
+	int ret = compress2(reinterpret_cast<Bytef*>(&out[sizeof(header)]), &compressed_size,
+	                    reinterpret_cast<const Bytef*>(data), size, level);
+	if(ret!=Z_OK || sizeof(header)+compressed_size>=size) return false;
+	out.resize(sizeof(header)+compressed_size);
+	return true;
+}
+
+bool FrameCompression::IsCompressed(const zmq::message_t& frame){
+	// only needs to look at the first byte of most frames, since rows and SQL don't begin with a null
+	return frame.size()>=sizeof(CompressedHeader) && static_cast<const char*>(frame.data())[0]=='\0' &&
+	       memcmp(frame.data(), COMPRESSED_MARKER, sizeof(COMPRESSED_MARKER))==0;
+}
+
+bool FrameCompression::Decompress(zmq::message_t& frame){
+	CompressedHeader header;
+	memcpy(&header, frame.data(), sizeof(header));
+	// deflate can't shrink anything by more than about 1032:1, so a larger raw_size is corrupt,
+	// and isn't allocated. Frames are also capped outright, well above any real row or statement.
+	size_t compressed_size = frame.size()-sizeof(header);
+	if(header.raw_size>MAX_RAW_SIZE || header.raw_size>compressed_size*MAX_RATIO+64) return false;
+	zmq::message_t raw(header.raw_size);
+	uLongf raw_size = header.raw_size;
+	int ret = uncompress(static_cast<Bytef*>(raw.data()), &raw_size,
+	                     static_cast<const Bytef*>(frame.data())+sizeof(header), compressed_size);
+	if(ret!=Z_OK || raw_size!=header.raw_size) return false;
+	frame.move(&raw);
+	return true;
+}
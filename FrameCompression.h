@@ -0,0 +1,29 @@
+#ifndef FRAMECOMPRESSION_H
+#define FRAMECOMPRESSION_H
+
+#include "zmq.hpp"
+#include "Protocol.h"
+
+#include <string>
+#include <cstddef>
+
+// zlib compression of individual message frames, for large statements (e.g. tool configs)
+// and result rows going to or from a middleman over a slow link.
+// A compressed frame is a CompressedHeader followed by the compressed data (see Protocol.h).
+class FrameCompression {
+	public:
+	// compress size bytes of data into out, header included. Returns false if that
+	// wouldn't make it any smaller, in which case the data should be sent as it is.
+	static bool Compress(const char* data, size_t size, std::string& out, int level);
+	
+	static bool IsCompressed(const zmq::message_t& frame);
+	
+	// replace a compressed frame with its original contents. Returns false if it's corrupt,
+	// including if it claims to be larger than MAX_RAW_SIZE or than its data could inflate to.
+	static bool Decompress(zmq::message_t& frame);
+	
+	static const size_t MAX_RATIO = 1032;
+	static const size_t MAX_RAW_SIZE = 1024*1024*1024;
+};
+
+#endif
@@ -0,0 +1,42 @@
+#include "FramePool.h"
+#include <cstring>
+
+FramePool::FramePool(size_t buffer_size_in, size_t max_free_buffers) : buffer_size(buffer_size_in), free_buffers(max_free_buffers) {
+	refs = 1;  // the owner's reference
+}
+
+FramePool::~FramePool(){
+	char* buf;
+	while(free_buffers.TryPop(buf)) delete[] buf;
+}
+
+bool FramePool::MakeFrame(const char* data, size_t size, zmq::message_t& frame){
+	if(size>buffer_size) return false;
+	
+	// reuse a returned buffer if there is one, otherwise make a new one.
+	char* buf;
+	if(not free_buffers.TryPop(buf)) buf = new char[buffer_size];
+	memcpy(buf, data, size);
+	
+	// each outstanding frame keeps the pool alive until zmq is done with it
+	refs.fetch_add(1, std::memory_order_relaxed);
+	frame.rebuild(buf, size, &FramePool::ReleaseFrame, this);
+	return true;
+}
+
+void FramePool::ReleaseFrame(void* data, void* hint){
+	// called by zmq (possibly from one of its I/O threads) when a frame is no longer needed
+	FramePool* pool = static_cast<FramePool*>(hint);
+	char* buf = static_cast<char*>(data);
+	// keep the buffer for reuse, unless we already have plenty
+	if(not pool->free_buffers.TryPush(std::move(buf))) delete[] buf;
+	pool->Unref();
+}
+
+void FramePool::Close(){
+	Unref();
+}
+
+void FramePool::Unref(){
+	if(refs.fetch_sub(1, std::memory_order_acq_rel)==1) delete this;
+}
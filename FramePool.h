@@ -0,0 +1,42 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include "zmq.hpp"
+#include "MPSCQueue.h"
+
+#include <atomic>
+#include <cstddef>
+
+// Pool of fixed-size buffers for building small outgoing zmq frames without a malloc/free per frame.
+// Frames are built on the PGClient background thread (the single consumer of the free list),
+// and zmq hands each buffer back from its I/O thread(s) when it has finished sending it.
+// Since zmq may still hold frames after the client shuts down, the pool is reference counted:
+// the owner calls Close() rather than deleting it, and the pool deletes itself once the last
+// outstanding frame has been released.
+class FramePool {
+	public:
+	FramePool(size_t buffer_size_in, size_t max_free_buffers);
+	
+	// copy size bytes of data into a pooled buffer and point frame at it.
+	// returns false (leaving frame untouched) if the data doesn't fit in a pool buffer.
+	bool MakeFrame(const char* data, size_t size, zmq::message_t& frame);
+	
+	// release the owner's reference
+	void Close();
+	
+	size_t BufferSize() const { return buffer_size; }
+	
+	private:
+	~FramePool();
+	static void ReleaseFrame(void* data, void* hint);
+	void Unref();
+	
+	size_t buffer_size;
+	MPSCQueue<char*> free_buffers;
+	std::atomic<long> refs;
+	
+	FramePool(const FramePool&) = delete;
+	FramePool& operator=(const FramePool&) = delete;
+};
+
+#endif
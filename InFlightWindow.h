@@ -0,0 +1,81 @@
+#ifndef INFLIGHTWINDOW_H
+#define INFLIGHTWINDOW_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+// Limits how many queries may be outstanding at once, both in total and separately
+// for reads (dealer socket) and writes (pub socket), so that many queries can be
+// pipelined to the middleman without the queues growing without bound.
+// A slot is taken when a query is submitted and given back when it is delivered.
+// Acquiring is a pair of atomic increments when there is room; callers only touch
+// the mutex/condition variable when they have to wait for room.
+class InFlightWindow {
+	public:
+	InFlightWindow(long max_total_in, long max_reads_in, long max_writes_in) :
+		max_total(max_total_in), max_reads(max_reads_in), max_writes(max_writes_in){
+		total = 0;
+		reads = 0;
+		writes = 0;
+		waiters = 0;
+	}
+
+	// take a slot for a query of the given type ('r' or 'w') without waiting
+	bool TryAcquire(char type){
+		std::atomic<long>& count = (type=='w') ? writes : reads;
+		long max_count = (type=='w') ? max_writes : max_reads;
+		if(total.fetch_add(1) >= max_total){
+			total.fetch_sub(1);
+			return false;
+		}
+		if(count.fetch_add(1) >= max_count){
+			count.fetch_sub(1);
+			total.fetch_sub(1);
+			return false;
+		}
+		return true;
+	}
+
+	// take a slot, waiting until the given time if the window is full
+	bool Acquire(char type, std::chrono::steady_clock::time_point until){
+		if(TryAcquire(type)) return true;
+		std::unique_lock<std::mutex> lock(mtx);
+		++waiters;
+		bool ok = cv.wait_until(lock, until, [this, type](){ return TryAcquire(type); });
+		--waiters;
+		return ok;
+	}
+
+	// return a slot taken by Acquire/TryAcquire
+	void Release(char type){
+		std::atomic<long>& count = (type=='w') ? writes : reads;
+		count.fetch_sub(1);
+		total.fetch_sub(1);
+		// only pay for the lock if someone is waiting. The waiter registers itself
+		// before re-checking the counts, so it either sees our release or gets notified.
+		if(waiters.load()>0){
+			{ std::lock_guard<std::mutex> lock(mtx); }
+			cv.notify_all();
+		}
+	}
+
+	long InFlight() const { return total.load(std::memory_order_relaxed); }
+	long InFlight(char type) const { return (type=='w') ? writes.load(std::memory_order_relaxed) : reads.load(std::memory_order_relaxed); }
+	long Max() const { return max_total; }
+
+	private:
+	long max_total;
+	long max_reads;
+	long max_writes;
+	std::atomic<long> total;
+	std::atomic<long> reads;
+	std::atomic<long> writes;
+
+	std::atomic<int> waiters;
+	std::mutex mtx;
+	std::condition_variable cv;
+};
+
+#endif
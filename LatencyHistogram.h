@@ -0,0 +1,93 @@
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// HDR-style histogram of latencies in microseconds: each power of two is split into 32 linear
+// buckets, so any value is recorded to within about 3%, from 1us up to about 12 days (larger
+// values are counted in the last bucket). Recording is a single relaxed atomic increment, and
+// each histogram is meant to have one writer; other threads may take snapshots at any time
+// without locking, which are consistent enough for reporting.
+// Percentiles are taken from snapshots, so the counts over an interval can be had by
+// subtracting an earlier snapshot from a later one.
+class LatencyHistogram {
+	public:
+	static const int sub_bits = 5;
+	static const size_t sub_count = 1<<sub_bits;
+	static const size_t n_buckets = 36*sub_count;
+
+	LatencyHistogram() : counts(n_buckets) {
+		for(std::atomic<uint64_t>& count : counts) count.store(0, std::memory_order_relaxed);
+		sum.store(0, std::memory_order_relaxed);
+	}
+
+	void Record(uint64_t us){
+		counts[Index(us)].fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(us, std::memory_order_relaxed);
+	}
+
+	struct Snapshot {
+		std::vector<uint64_t> counts;
+		uint64_t sum = 0;
+		uint64_t Count() const {
+			uint64_t total = 0;
+			for(uint64_t count : counts) total += count;
+			return total;
+		}
+		// the latency below which a fraction q of the recorded values lie (0 if there are none)
+		uint64_t Percentile(double q) const {
+			uint64_t total = Count();
+			if(total==0) return 0;
+			uint64_t rank = q*total;
+			if(rank>=total) rank = total-1;
+			uint64_t seen = 0;
+			for(size_t i=0; i<counts.size(); ++i){
+				seen += counts[i];
+				if(seen>rank) return Value(i);
+			}
+			return Value(counts.size()-1);
+		}
+		// the values recorded since an earlier snapshot
+		Snapshot Since(const Snapshot& earlier) const {
+			Snapshot diff = *this;
+			if(earlier.counts.size()!=counts.size()) return diff;
+			for(size_t i=0; i<counts.size(); ++i) diff.counts[i] -= earlier.counts[i];
+			diff.sum -= earlier.sum;
+			return diff;
+		}
+	};
+
+	Snapshot Take() const {
+		Snapshot snapshot;
+		snapshot.counts.resize(n_buckets);
+		for(size_t i=0; i<n_buckets; ++i) snapshot.counts[i] = counts[i].load(std::memory_order_relaxed);
+		snapshot.sum = sum.load(std::memory_order_relaxed);
+		return snapshot;
+	}
+
+	static size_t Index(uint64_t us){
+		if(us<sub_count) return us;
+		int msb = 63-__builtin_clzll(us);
+		int shift = msb-sub_bits;
+		size_t index = (shift+1)*sub_count + ((us>>shift)-sub_count);
+		return (index<n_buckets) ? index : n_buckets-1;
+	}
+	// the smallest value counted in a bucket
+	static uint64_t Value(size_t index){
+		if(index<sub_count) return index;
+		int shift = index/sub_count - 1;
+		return (uint64_t)(index%sub_count + sub_count) << shift;
+	}
+
+	private:
+	std::vector<std::atomic<uint64_t>> counts;
+	std::atomic<uint64_t> sum;
+
+	LatencyHistogram(const LatencyHistogram&) = delete;
+	LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+};
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+// Bounded lock-free multi-producer single-consumer ring buffer.
+// Any number of threads may call TryPush concurrently; only one thread
+// (the PGClient background thread) may call TryPop / Empty.
+// Each cell carries a sequence number that tells producers and the consumer
+// whether it is free to write or ready to read, so producers only contend
+// on a single fetch-and-increment style CAS of the enqueue position.
+// Capacity is rounded up to the next power of two.
+template <typename T>
+class MPSCQueue {
+	public:
+	explicit MPSCQueue(size_t capacity_in){
+		capacity = 2;
+		while(capacity < capacity_in) capacity <<= 1;
+		mask = capacity - 1;
+		cells.reset(new Cell[capacity]);
+		for(size_t i=0; i<capacity; ++i) cells[i].sequence.store(i, std::memory_order_relaxed);
+		enqueue_pos.store(0, std::memory_order_relaxed);
+		dequeue_pos.store(0, std::memory_order_relaxed);
+	}
+
+	// returns false if the queue is full; item is left untouched in that case
+	bool TryPush(T&& item){
+		Cell* cell;
+		size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		while(true){
+			cell = &cells[pos & mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if(diff==0){
+				// cell is free for this position; try to claim it
+				if(enqueue_pos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+			} else if(diff<0){
+				// consumer hasn't freed this cell yet: full
+				return false;
+			} else {
+				// another producer beat us to it
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+		cell->data = std::move(item);
+		cell->sequence.store(pos+1, std::memory_order_release);
+		return true;
+	}
+
+	// consumer only. returns false if there is nothing ready to pop.
+	bool TryPop(T& item){
+		size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		Cell* cell = &cells[pos & mask];
+		size_t seq = cell->sequence.load(std::memory_order_acquire);
+		if((intptr_t)seq - (intptr_t)(pos+1) < 0) return false;
+		item = std::move(cell->data);
+		cell->data = T();  // release anything the moved-from item still holds
+		cell->sequence.store(pos+capacity, std::memory_order_release);
+		dequeue_pos.store(pos+1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// consumer only
+	bool Empty() const {
+		size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		return cells[pos & mask].sequence.load(std::memory_order_acquire) != pos+1;
+	}
+
+	// approximate number of queued items; safe to call from any thread
+	size_t Size() const {
+		size_t head = dequeue_pos.load(std::memory_order_relaxed);
+		size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+		return (tail>head) ? tail-head : 0;
+	}
+
+	size_t Capacity() const { return capacity; }
+
+	private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	std::unique_ptr<Cell[]> cells;
+	size_t capacity;
+	size_t mask;
+
+	// keep producer and consumer positions on separate cache lines.
+	// (padding rather than alignas, since pre-C++17 new ignores extended alignment)
+	char pad0[64];
+	std::atomic<size_t> enqueue_pos;
+	char pad1[64];
+	std::atomic<size_t> dequeue_pos;
+	char pad2[64];
+
+	MPSCQueue(const MPSCQueue&) = delete;
+	MPSCQueue& operator=(const MPSCQueue&) = delete;
+};
+
+#endif
@@ -1,10 +1,14 @@
 #include "PGClient.h"
 #include "DataModel.h"
 #include <errno.h>
+#include <algorithm>
+#include <cctype>
+#include <set>
+#include <sstream>
 
 Query::Query(std::string dbname_in, std::string query_string_in, char type_in){
-	dbname = dbname_in;
-	query_string = query_string_in;
+	dbname = std::move(dbname_in);
+	query_string = std::move(query_string_in);
 	type = type_in;
 }
 
@@ -16,6 +20,10 @@ Query::Query(const Query& qry_in){
 	query_response = qry_in.query_response;
 	err = qry_in.err;
 	msg_id = qry_in.msg_id;
+	statement_id = qry_in.statement_id;
+	n_params = qry_in.n_params;
+	params = qry_in.params;
+	times = qry_in.times;
 }
 
 void PGClient::SetDataModel(DataModel* m_data_in){
@@ -35,10 +43,112 @@ bool PGClient::Initialise(std::string configfile){
 	/* ----------------------------------------- */
 	verbosity = 3;
 	max_retries = 3;
+	resend_writes = 0;          // whether writes are resent too (see Retries)
+	submit_queue_size = 8192;  // max queries waiting to be sent (rounded up to a power of 2)
+	correlation_slots = 131072; // max queries awaiting a response (rounded up to a power of 2)
+	send_batch_size = 256;      // max queries sent per background thread wakeup
+	zero_copy_threshold = 1024; // query strings this size or larger are sent without being copied
+	stream_chunk_rows = 1000;   // rows per chunk for streaming reads
+	stream_window = 4;          // chunks a streaming read may have in flight
+	write_batching = 0;         // whether to group INSERTs to the same table into one message
+	fire_and_forget_writes = 0; // whether SendQuery returns as soon as a write is queued
+	read_cache_bytes = 0;       // memory for caching read results; 0 disables the cache
+	read_cache_ttl_ms = 1000;   // how long cached results are used for, unless set per table
+	single_flight_reads = 1;    // whether identical reads in flight at the same time share one request
+	write_batch_rows = 500;     // max writes per batch
+	write_batch_delay_ms = 5;   // max time a write waits for its batch to fill
+	lookup_batch_keys = 1000;   // max point lookups combined into one query
+	lookup_batch_delay_ms = 2;  // max time a lookup waits for others to combine with
+	compress_threshold = 0;     // frames this size or larger are compressed; 0 disables compression
+	compress_level = 1;         // zlib level, 1 (fastest) to 9 (smallest)
+	middleman_decompresses = false;
+	hedge_reads = 0;            // whether to send a second copy of slow reads, in case another middleman is quicker
+	hedge_percentile = 95;      // a read is slow once it has taken longer than this percentile of recent reads
+	hedge_min_delay_ms = 1;     // but never hedge sooner than this
+	read_routing = "round_robin";  // how reads are shared between middlemen: round_robin, p2c or least_outstanding
+	read_routing_probe_ms = 1000;  // with p2c or least_outstanding, try a middleman not used for this long
+	leader_writes = 0;          // whether to send writes only to the master middleman, rather than publish them to all
+	master_service = "psql_master";  // the service the master middleman advertises its write port as
+	master_check_period_ms = 1000;   // how often to look for a new master
+	master_expiry_ms = 60000;   // how long a former master's adverts may linger in service discovery
+	write_topics = 0;           // writes start with a topic middlemen can subscribe to: 0 none, 1 database, 2 database and table
+	receive_batch_size = 256;   // max responses received per background thread wakeup
+	int flight_recorder_size = 1024;      // recent queries whose timings are kept; 0 disables the flight recorder
+	int flight_recorder_dump_ms = 10000;  // on a timeout, log the flight recorder, at most this often (0: never)
+	max_in_flight = 10000;      // max queries submitted but not yet completed
+	backpressure_timeout_ms = -1;  // if max_in_flight is reached: -1 wait up to the query timeout,
+	                               // 0 fail immediately, >0 wait at most this many ms
 	m_variables.Get("verbosity",verbosity);
 	m_variables.Get("max_retries",max_retries);
+	m_variables.Get("resend_writes",resend_writes);
+	m_variables.Get("submit_queue_size",submit_queue_size);
+	m_variables.Get("correlation_slots",correlation_slots);
+	m_variables.Get("send_batch_size",send_batch_size);
+	m_variables.Get("receive_batch_size",receive_batch_size);
+	m_variables.Get("zero_copy_threshold",zero_copy_threshold);
+	m_variables.Get("stream_chunk_rows",stream_chunk_rows);
+	m_variables.Get("stream_window",stream_window);
+	m_variables.Get("write_batching",write_batching);
+	m_variables.Get("fire_and_forget_writes",fire_and_forget_writes);
+	m_variables.Get("read_cache_bytes",read_cache_bytes);
+	m_variables.Get("read_cache_ttl_ms",read_cache_ttl_ms);
+	m_variables.Get("single_flight_reads",single_flight_reads);
+	m_variables.Get("write_batch_rows",write_batch_rows);
+	m_variables.Get("write_batch_delay_ms",write_batch_delay_ms);
+	m_variables.Get("lookup_batch_keys",lookup_batch_keys);
+	m_variables.Get("lookup_batch_delay_ms",lookup_batch_delay_ms);
+	m_variables.Get("compress_threshold",compress_threshold);
+	m_variables.Get("compress_level",compress_level);
+	m_variables.Get("hedge_reads",hedge_reads);
+	m_variables.Get("hedge_percentile",hedge_percentile);
+	m_variables.Get("hedge_min_delay_ms",hedge_min_delay_ms);
+	m_variables.Get("read_routing",read_routing);
+	m_variables.Get("read_routing_probe_ms",read_routing_probe_ms);
+	m_variables.Get("leader_writes",leader_writes);
+	m_variables.Get("master_service",master_service);
+	m_variables.Get("master_check_period_ms",master_check_period_ms);
+	m_variables.Get("master_expiry_ms",master_expiry_ms);
+	m_variables.Get("write_topics",write_topics);
+	m_variables.Get("flight_recorder_size",flight_recorder_size);
+	m_variables.Get("flight_recorder_dump_ms",flight_recorder_dump_ms);
+	m_variables.Get("max_in_flight",max_in_flight);
+	m_variables.Get("backpressure_timeout_ms",backpressure_timeout_ms);
+	// separate limits for reads (dealer socket) and writes (pub socket), within the overall limit
+	max_in_flight_reads = max_in_flight;
+	max_in_flight_writes = max_in_flight;
+	m_variables.Get("max_in_flight_reads",max_in_flight_reads);
+	m_variables.Get("max_in_flight_writes",max_in_flight_writes);
+	
+	// the queues must be able to hold everything the window lets in. Give the correlation
+	// table some headroom so new ids rarely land on a slot still held by a slow query.
+	if(submit_queue_size<max_in_flight) submit_queue_size = max_in_flight;
+	if(correlation_slots<2*max_in_flight) correlation_slots = 2*max_in_flight;
+	
+	waiting_senders = new MPSCQueue<PendingQuery>(submit_queue_size);
+	waiting_recipients = new CorrelationTable<PendingQuery>(correlation_slots);
+	in_flight_window = new InFlightWindow(max_in_flight, max_in_flight_reads, max_in_flight_writes);
+	// smaller frames are copied into pooled buffers
+	frame_pool = new FramePool(zero_copy_threshold, send_batch_size*4);
+	if(write_batching) write_batcher = new QueryBatcher<PendingQuery>(write_batch_rows, std::chrono::milliseconds(write_batch_delay_ms));
+	lookup_batcher = new QueryBatcher<PendingQuery>(lookup_batch_keys, std::chrono::milliseconds(lookup_batch_delay_ms));
+	if(read_cache_bytes>0) read_cache = new ReadCache(read_cache_bytes, std::chrono::milliseconds(read_cache_ttl_ms));
+	if(flight_recorder_size>0) flight_recorder = new FlightRecorder(flight_recorder_size);
+	flight_dump_period = std::chrono::milliseconds(flight_recorder_dump_ms);
 	
 	get_ok = InitLogging();
+	// reads go to middlemen of our choosing, rather than in turn, if read_routing says so
+	if(read_routing=="p2c"){
+		peers = new PeerSelector(PeerSelector::P2C, std::chrono::milliseconds(read_routing_probe_ms));
+	} else if(read_routing=="least_outstanding"){
+		peers = new PeerSelector(PeerSelector::LEAST_OUTSTANDING, std::chrono::milliseconds(read_routing_probe_ms));
+	} else if(read_routing!="round_robin"){
+		Log("Unknown read_routing '"+read_routing+"', using round_robin",v_warning,verbosity);
+	}
+	if(peers){
+		// there's no falling back to round robin on the same port, so make the requirement plain
+		Log("read_routing "+read_routing+": reads can only go to middlemen that have announced themselves"
+		    " on connecting (ZMQ_PROBE_ROUTER) or acknowledged a write; until one has, reads fail",v_warning,verbosity);
+	}
 	get_ok = InitZMQ();
 	if(not get_ok) return false;
 	get_ok &= InitServiceDiscovery();
@@ -91,7 +201,9 @@ bool PGClient::InitZMQ(){
 	
 	// we have two zmq sockets:
 	// 1. [PUB]    one for sending write queries to all listeners (the master)
+	//    (plus a [PUSH] for sending them to just the master, if leader_writes is set)
 	// 2. [DEALER] one for sending read queries round-robin and receving responses
+	//    (or a [ROUTER], if read_routing picks which middleman each read goes to)
 	
 	// specify the ports everything talks/listens on
 	clt_pub_port = 77778;   // for sending write queries
@@ -100,8 +212,7 @@ bool PGClient::InitZMQ(){
 	int clt_pub_socket_timeout=500;
 	int clt_dlr_socket_timeout=500;  // both send and receive
 	
-	// poll timeouts - units are milliseconds
-	inpoll_timeout=500;
+	// poll timeout for sending - units are milliseconds
 	outpoll_timeout=500;
 	
 	// total timeout on how long we wait for response from a query
@@ -112,10 +223,15 @@ bool PGClient::InitZMQ(){
 	m_variables.Get("clt_dlr_port",clt_dlr_port);
 	m_variables.Get("clt_pub_socket_timeout",clt_pub_socket_timeout);
 	m_variables.Get("clt_dlr_socket_timeout",clt_dlr_socket_timeout);
-	m_variables.Get("inpoll_timeout",inpoll_timeout);
 	m_variables.Get("outpoll_timeout",outpoll_timeout);
 	m_variables.Get("query_timeout",query_timeout);
 	
+	// port to serve metrics on (0: don't), and the interface to serve them on
+	metrics_port = 0;
+	metrics_address = "127.0.0.1";
+	m_variables.Get("metrics_port",metrics_port);
+	m_variables.Get("metrics_address",metrics_address);
+	
 	// to send replies the middleman must know who to send them to.
 	// for read queries, the receiving router socket will append the ZMQ_IDENTITY of the sender
 	// which can be given to the sending router socket to identify the recipient.
@@ -143,24 +259,72 @@ bool PGClient::InitZMQ(){
 	// -------------------------------
 	clt_pub_socket = new zmq::socket_t(*context, ZMQ_PUB);
 	clt_pub_socket->setsockopt(ZMQ_SNDTIMEO, clt_pub_socket_timeout);
+	// PUB sockets silently drop messages beyond the high water mark, so allow the whole window
+	clt_pub_socket->setsockopt(ZMQ_SNDHWM, max_in_flight_writes);
 	clt_pub_socket->bind(std::string("tcp://*:")+std::to_string(clt_pub_port));
 	
+	// socket to send write queries to just the master middleman
+	// ---------------------------------------------------------
+	if(leader_writes){
+		// connected to the master by FindMaster, once service discovery has found it
+		clt_wrt_socket = new zmq::socket_t(*context, ZMQ_PUSH);
+		clt_wrt_socket->setsockopt(ZMQ_SNDTIMEO, clt_pub_socket_timeout);
+		clt_wrt_socket->setsockopt(ZMQ_SNDHWM, max_in_flight_writes);
+		// only queue writes while actually connected; otherwise they're published as before
+		int immediate = 1;
+		clt_wrt_socket->setsockopt(ZMQ_IMMEDIATE, immediate);
+	}
+	
 	// socket to deal read queries and receive responses
 	// -------------------------------------------------
-	clt_dlr_socket = new zmq::socket_t(*context, ZMQ_DEALER);
+	clt_dlr_socket = new zmq::socket_t(*context, (peers) ? ZMQ_ROUTER : ZMQ_DEALER);
 	clt_dlr_socket->setsockopt(ZMQ_SNDTIMEO, clt_dlr_socket_timeout);
 	clt_dlr_socket->setsockopt(ZMQ_RCVTIMEO, clt_dlr_socket_timeout);
+	clt_dlr_socket->setsockopt(ZMQ_SNDHWM, max_in_flight_reads);
+	// acknowledgements of writes come back on this socket too
+	clt_dlr_socket->setsockopt(ZMQ_RCVHWM, max_in_flight);
 	clt_dlr_socket->setsockopt(ZMQ_IDENTITY, clt_ID.c_str(), clt_ID.length());
+	if(peers){
+		// fail sends to middlemen that have gone, rather than silently dropping them.
+		// Middlemen are only known once they've sent something, so they should announce
+		// themselves as they connect (ZMQ_PROBE_ROUTER).
+		int mandatory = 1;
+		clt_dlr_socket->setsockopt(ZMQ_ROUTER_MANDATORY, mandatory);
+	}
 	clt_dlr_socket->bind(std::string("tcp://*:")+std::to_string(clt_dlr_port));
 	
+	// socket to answer requests for metrics, from REQ sockets.
+	// A router rather than a REP socket, so a reply that can't be sent doesn't leave it
+	// unable to receive the next request.
+	// -------------------------------------
+	if(metrics_port>0){
+		clt_metrics_socket = new zmq::socket_t(*context, ZMQ_ROUTER);
+		clt_metrics_socket->setsockopt(ZMQ_SNDTIMEO, clt_dlr_socket_timeout);
+		int linger = 0;
+		clt_metrics_socket->setsockopt(ZMQ_LINGER, linger);
+		clt_metrics_socket->bind(std::string("tcp://")+metrics_address+":"+std::to_string(metrics_port));
+	}
+	
+	// eventfd used to wake the background thread as soon as a query is submitted.
+	// zmq::poll accepts plain file descriptors, so it sits in the same poll set as the sockets.
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(wake_fd<0){
+		Log(std::string("Error creating wakeup eventfd: ")+strerror(errno),v_error,verbosity);
+		return false;
+	}
+	
 	// bundle the polls together so we can do all of them at once
 	zmq::pollitem_t clt_pub_socket_pollout= zmq::pollitem_t{*clt_pub_socket,0,ZMQ_POLLOUT,0};
 	zmq::pollitem_t clt_dlr_socket_pollin = zmq::pollitem_t{*clt_dlr_socket,0,ZMQ_POLLIN,0};
 	zmq::pollitem_t clt_dlr_socket_pollout = zmq::pollitem_t{*clt_dlr_socket,0,ZMQ_POLLOUT,0};
+	zmq::pollitem_t wake_fd_pollin = zmq::pollitem_t{nullptr,wake_fd,ZMQ_POLLIN,0};
 	
-	in_polls = std::vector<zmq::pollitem_t>{clt_dlr_socket_pollin};
+	in_polls = std::vector<zmq::pollitem_t>{clt_dlr_socket_pollin,
+	                                        wake_fd_pollin};
+	if(clt_metrics_socket) in_polls.push_back(zmq::pollitem_t{*clt_metrics_socket,0,ZMQ_POLLIN,0});
 	out_polls = std::vector<zmq::pollitem_t>{clt_pub_socket_pollout,
 	                                         clt_dlr_socket_pollout};
+	if(clt_wrt_socket) out_polls.push_back(zmq::pollitem_t{*clt_wrt_socket,0,ZMQ_POLLOUT,0});
 	
 	return true;
 }
@@ -192,8 +356,9 @@ bool PGClient::InitServiceDiscovery(){
 	
 	// we do wish to send broadcasts advertising our services
 	bool send_broadcasts = true;
-	// the ServiceDiscovery class can also listen for other service providers, but we don't need to.
-	bool rcv_broadcasts = false;
+	// the ServiceDiscovery class can also listen for other service providers.
+	// We only need to if we're looking for the master middleman.
+	bool rcv_broadcasts = (leader_writes!=0);
 	
 	// multicast address and port to broadcast on. must match the middleman.
 	std::string broadcast_address = "239.192.1.1";
@@ -245,6 +410,11 @@ bool PGClient::RegisterServices(){
 	// we can now register the client sockets with the following:
 	utilities->AddService("psql_write", clt_pub_port);
 	utilities->AddService("psql_read",  clt_dlr_port);
+	// metrics served only on a loopback interface can't be reached by anyone discovering them
+	metrics_advertised = clt_metrics_socket && metrics_address.compare(0, 4, "127.")!=0 &&
+	                     metrics_address!="localhost" && metrics_address!="::1";
+	if(metrics_advertised) utilities->AddService("psql_metrics", metrics_port);
+	else if(clt_metrics_socket) Log("Metrics served on "+metrics_address+" only; not advertising them",v_message,verbosity);
 	
 	return true;
 }
@@ -281,62 +451,141 @@ bool PGClient::BackgroundThread(std::future<void> signaller){
 	
 	std::cout<<"BackgroundThread starting!"<<std::endl;
 	while(true){
-		// check if we've been signalled to terminate
-		std::chrono::milliseconds span(10);
-		if(signaller.wait_for(span)!=std::future_status::timeout){
+		// check if we've been signalled to terminate (Finalise also wakes us)
+		if(signaller.wait_for(std::chrono::seconds(0))!=std::future_status::timeout){
 			// terminate has been set
 			std::cout<<"background thread received terminate signal"<<std::endl;
 			break;
 		}
 		
-		// otherwise continue our duties
-		get_ok = GetNextRespose();
+		// sleep until a response arrives, a query is submitted, the next query times out,
+		// or stats are due to be printed.
+		// if there are still queries waiting to go out, just check for responses and carry on.
+		long timeout = -1;
+		if(not waiting_senders->Empty()){
+			timeout = 0;
+		} else if(not deadlines.empty() || (write_batcher && not write_batcher->Empty()) || not lookup_batcher->Empty() || clt_wrt_socket ||
+		          print_stats_period.total_milliseconds()>0){
+			std::chrono::steady_clock::time_point wake_at = std::chrono::steady_clock::time_point::max();
+			if(not deadlines.empty()) wake_at = deadlines.top().first;
+			if(print_stats_period.total_milliseconds()>0){
+				boost::posix_time::time_duration since_printout = boost::posix_time::microsec_clock::universal_time()-last_printout;
+				wake_at = std::min(wake_at, std::chrono::steady_clock::now() +
+				                   std::chrono::microseconds((print_stats_period-since_printout).total_microseconds()));
+			}
+			if(clt_wrt_socket) wake_at = std::min(wake_at, next_master_check);
+			if(write_batcher && not write_batcher->Empty()) wake_at = std::min(wake_at, write_batcher->NextDue());
+			if(not lookup_batcher->Empty()) wake_at = std::min(wake_at, lookup_batcher->NextDue());
+			std::chrono::steady_clock::duration wait = wake_at - std::chrono::steady_clock::now();
+			timeout = std::chrono::duration_cast<std::chrono::milliseconds>(wait).count() + 1;
+			if(timeout<0) timeout = 0;
+		}
+		int ret = zmq::poll(in_polls.data(), in_polls.size(), timeout);
+		if(ret<0){
+			Log("BackgroundThread error polling! Are sockets closed?",v_error,verbosity);
+			continue;
+		}
+		
+		// reset the wakeup counter. Any submissions after this will trigger another wakeup.
+		if(in_polls.at(1).revents & ZMQ_POLLIN){
+			uint64_t wakeups;
+			// EAGAIN just means there was nothing to reset
+			if(read(wake_fd, &wakeups, sizeof(wakeups))<0 && errno!=EAGAIN){
+				Log(std::string("BackgroundThread error reading wakeup eventfd: ")+strerror(errno),v_error,verbosity);
+			}
+		}
+		
+		// continue our duties
+		if(in_polls.at(0).revents & ZMQ_POLLIN) get_ok = GetNextRespose();
+		if(clt_metrics_socket && (in_polls.at(2).revents & ZMQ_POLLIN)) get_ok = ServeMetrics();
+		get_ok = CheckTimeouts();
 		get_ok = SendNextQuery();
+		if(clt_wrt_socket) get_ok = FindMaster();
+		if(print_stats_period.total_milliseconds()>0){
+			boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+			if(now-last_printout >= print_stats_period) PrintStats(now);
+		}
 		//get_ok = FindNewClients();     FOR MIDDLEMAN ONLY
 	}
 	
+	// fail anything still queued or awaiting a response, so no caller is left waiting
+	PendingQuery pending;
+	std::vector<std::vector<PendingQuery>> unsent;
+	if(write_batcher) write_batcher->TakeDue(std::chrono::steady_clock::now(), unsent, true);
+	lookup_batcher->TakeDue(std::chrono::steady_clock::now(), unsent, true);
+	for(std::vector<PendingQuery>& batch : unsent){
+		for(PendingQuery& member : batch){
+			member.qry.success = false;
+			member.qry.err = "PGClient shutting down";
+			Deliver(member);
+		}
+	}
+	while(waiting_senders->TryPop(pending)){
+		pending.qry.success = false;
+		pending.qry.err = "PGClient shutting down";
+		Deliver(pending);
+	}
+	while(not deadlines.empty()){
+		if(waiting_recipients->Cancel(deadlines.top().second, pending)){
+			pending.qry.success = false;
+			pending.qry.err = "PGClient shutting down";
+			Deliver(pending);
+		}
+		deadlines.pop();
+	}
+	
 	return true;
 }
 
+void PGClient::Wake(){
+	// bump the eventfd counter so the background thread's poll returns immediately
+	uint64_t one = 1;
+	// EAGAIN means the counter is saturated, so a wakeup is already pending
+	if(write(wake_fd, &one, sizeof(one))<0 && errno!=EAGAIN){
+		Log(std::string("Failed to wake background thread: ")+strerror(errno),v_error,verbosity);
+	}
+}
+
 bool PGClient::SendQuery(std::string dbname, std::string query_string, std::vector<std::string>* results, int* timeout_ms, std::string* err){
+	// wrapper for when user wants the rows as strings
+	ResultSet resultset;
+	bool ret = SendQuery(std::move(dbname), std::move(query_string), &resultset, timeout_ms, err);
+	if(results) resultset.CopyTo(*results);
+	return ret;
+}
+
+bool PGClient::SendQuery(std::string dbname, std::string query_string, ResultSet* results, int* timeout_ms, std::string* err){
 	// send a query and receive response.
 	// This is a wrapper that ensures we always return within the requested timeout.
 	
-	// we need to send reads and writes to different sockets.
-	// we could ask the user to specify, or try to determine it ourselves
-	bool is_write_txn = (query_string.find("INSERT")!=std::string::npos) ||
-	                    (query_string.find("UPDATE")!=std::string::npos) ||
-	                    (query_string.find("DELETE")!=std::string::npos);
-	char type = (is_write_txn) ? 'w' : 'r';
+	int timeout=query_timeout;              // default timeout for submission of query and receipt of response
+	if(timeout_ms) timeout=*timeout_ms;     // override by user if a custom timeout is given
 	
-	// encapsulate the query in an object.
-	// We need this since we can only get one return value from an asynchronous function call,
-	// and we want both a response string and error flag.
-	Query qry{dbname, query_string, type};
+	// in fire-and-forget mode writes return as soon as they're queued
+	if(fire_and_forget_writes && GetQueryType(query_string)=='w'){
+		if(results) *results = ResultSet();
+		if(err) err->clear();
+		return SubmitWrite(std::move(dbname), std::move(query_string), err);
+	}
 	
 	// submit the query asynchrously.
-	// This way we have control over how long we wait for the response
 	// The response will be a Query object with remaining members populated.
-	std::future<Query> response = std::async(std::launch::async, &PGClient::DoQuery, this, qry);
+	std::future<Query> response = SubmitQuery(dbname, std::move(query_string), &timeout);
 	
-	// the return from a std::async call is a 'future' object
-	// this object will be populated with the return value when it becomes available,
+	// the background thread will always resolve the future by the timeout,
 	// but we can wait for a given timeout and then bail if it hasn't resolved in time.
-	
-	int timeout=query_timeout;              // default timeout for submission of query and receipt of response
-	if(timeout_ms) timeout=*timeout_ms;     // override by user if a custom timeout is given
 	std::chrono::milliseconds span(timeout);
 	// wait_for will return either when the result is ready, or when it times out
 	if(response.wait_for(span)!=std::future_status::timeout){
 		// we got a response in time. retrieve and parse return value
-		qry = response.get();
-		if(results) *results = qry.query_response;
+		Query qry = response.get();
+		if(results) *results = std::move(qry.query_response);
 		if(err) *err = qry.err;
 		return qry.success;
 	} else {
 		// timed out
 		std::string errmsg="Timed out after waiting "+std::to_string(timeout)+"ms for response "
-		                   "from read query '"+query_string+"'";
+		                   "from query on database '"+dbname+"'";
 		if(verbosity>3) std::cerr<<errmsg<<std::endl;
 		if(err) *err=errmsg;
 		return false;
@@ -348,9 +597,9 @@ bool PGClient::SendQuery(std::string dbname, std::string query_string, std::vect
 bool PGClient::SendQuery(std::string dbname, std::string query_string, std::string* results, int* timeout_ms, std::string* err){
 	// wrapper for when user expects only one returned row
 	if(err) *err="";
-	std::vector<std::string> resultsvec;
-	bool ret = SendQuery(dbname, query_string, &resultsvec, timeout_ms, err);
-	if(resultsvec.size()>0 && results!=nullptr) *results = resultsvec.front();
+	ResultSet resultsvec;
+	bool ret = SendQuery(std::move(dbname), std::move(query_string), &resultsvec, timeout_ms, err);
+	if(resultsvec.size()>0 && results!=nullptr) *results = resultsvec.String(0);
 	// if more than one row returned, flag as error
 	if(resultsvec.size()>1){
 		*err += ". Query returned "+std::to_string(resultsvec.size())+" rows!";
@@ -359,100 +608,868 @@ bool PGClient::SendQuery(std::string dbname, std::string query_string, std::stri
 	return ret;
 }
 
-Query PGClient::DoQuery(Query qry){
-	std::cout<<"PGClient DoQuery received query"<<std::endl;
-	// submit a query, wait for the response and return it
+std::future<Query> PGClient::SubmitQuery(std::string dbname, std::string query_string, int* timeout_ms){
+	// submit a query without blocking; the returned future is resolved by the background thread
+	// with the response, or with an error once the timeout expires.
+	// std::function needs a copyable callable, so share the promise.
+	std::shared_ptr<std::promise<Query>> ticket = std::make_shared<std::promise<Query>>();
+	std::future<Query> receipt = ticket->get_future();
+	
+	char type = GetQueryType(query_string);
+	std::string err;
+	bool ok = SubmitQuery(dbname, std::move(query_string), [ticket](Query& qry){ ticket->set_value(std::move(qry)); }, timeout_ms, &err);
+	if(not ok){
+		// never got submitted, so the callback won't be invoked. Resolve the future ourselves.
+		Query qry{dbname, "", type};
+		qry.success = false;
+		qry.err = err;
+		ticket->set_value(qry);
+	}
 	
-	// capture a unique id for this message
-	int thismsgid = ++msg_id;
-	qry.msg_id = thismsgid;
+	return receipt;
+}
+
+bool PGClient::SubmitQuery(std::string dbname, std::string query_string, QueryCallback callback, int* timeout_ms, std::string* err){
+	// submit a query without blocking. callback will be invoked by the background thread
+	// with the response, or with an error once the timeout expires.
+	// returns false (and the callback is never invoked) if the query could not be queued.
+	
+	// encapsulate the query in an object, along with who to notify on completion and when to give up
+	PendingQuery pending;
+	char type = GetQueryType(query_string);
+	
+	// answer repeated reads from the cache, if enabled
+	if(read_cache && type=='r'){
+		pending.cache_key = read_cache->Key(dbname, query_string);
+		ResultSet cached;
+		if(not pending.cache_key.empty() && read_cache->Lookup(pending.cache_key, cached)){
+			Query qry{std::move(dbname), std::move(query_string), type};
+			qry.success = true;
+			qry.msg_id = 0;
+			qry.query_response = std::move(cached);
+			try {
+				callback(qry);
+			} catch(std::exception& e){
+				Log(std::string("Exception in query callback: ")+e.what(),v_error,verbosity);
+			} catch(...){
+				Log("Unknown exception in query callback",v_error,verbosity);
+			}
+			return true;
+		}
+		// results from before any write we send from now on are out of date
+		pending.cache_epoch = read_cache->Epoch();
+	}
+	pending.qry = Query{std::move(dbname), std::move(query_string), type};
+	pending.callback = std::move(callback);
+	pending.timeout = std::chrono::milliseconds((timeout_ms) ? *timeout_ms : query_timeout);
 	
-	// zmq sockets aren't thread-safe, so we have one central sender.
-	// submit our query and keep a ticket to retrieve the return status on completion
-	std::promise<int> send_ticket;
-	std::future<int> send_receipt = send_ticket.get_future();
-	std::cout<<"PGClient enqueing query "<<qry.msg_id<<std::endl;
-	waiting_senders.emplace(qry, std::move(send_ticket));
-	
-	// wait for our number to come up. loooong timeout, but don't hang forever.
-	if(send_receipt.wait_for(std::chrono::seconds(30))==std::future_status::timeout){
-		// sending timed out
-		if(qry.type=='w') ++write_queries_failed;
-		else if(qry.type=='r') ++read_queries_failed;
-		Log("Timed out sending query "+std::to_string(thismsgid),v_warning,verbosity);
-		qry.success = false;
-		qry.err = "Timed out sending query";
-		return qry;
-	} // else got a return value
+	return Submit(std::move(pending), err);
+}
+
+bool PGClient::SubmitStreamingQuery(std::string dbname, std::string query_string, RowCallback on_rows, QueryCallback on_done, int* timeout_ms, std::string* err){
+	// submit a read whose rows are handed to on_rows in chunks as they arrive,
+	// rather than being collected into the Query passed to on_done.
+	char type = GetQueryType(query_string);
+	if(type!='r' || not on_rows){
+		if(err) *err = "Streaming is only supported for read queries with a row callback";
+		return false;
+	}
+	// flow control must reach the middleman sending the chunks, which the dealer socket used
+	// with round_robin can't address: it would go to whichever middleman is next in turn
+	if(not peers){
+		if(err) *err = "Streaming reads need read_routing p2c or least_outstanding";
+		return false;
+	}
+	PendingQuery pending;
+	pending.qry = Query{std::move(dbname), std::move(query_string), type};
+	pending.callback = std::move(on_done);
+	pending.on_rows = std::move(on_rows);
+	pending.timeout = std::chrono::milliseconds((timeout_ms) ? *timeout_ms : query_timeout);
 	
-	// check for errors sending
-	int ret = send_receipt.get();
-	std::string errmsg;
-	if(ret==-3) errmsg="Error polling out socket in PollAndSend! Is socket closed?";
-	if(ret==-2) errmsg="No listener on out socket in PollAndSend!";
-	if(ret==-1) errmsg="Error sending in PollAndSend!";
-	if(ret!=0){
-		if(qry.type=='w') ++write_queries_failed;
-		else if(qry.type=='r') ++read_queries_failed;
-		Log(errmsg,v_debug,verbosity);
-		qry.success = false;
-		qry.err = errmsg;
-		return qry;
+	return Submit(std::move(pending), err);
+}
+
+bool PGClient::SubmitWrite(std::string dbname, std::string query_string, std::string* err){
+	// queue a write without waiting for its acknowledgement, and without ever blocking:
+	// if there's no room it's rejected immediately. Its outcome is only counted
+	// (and passed to the write error callback if it fails), on the background thread.
+	// a read would go to a middleman with nothing to take its result
+	char type = GetQueryType(query_string);
+	if(type!='w'){
+		if(err) *err = "SubmitWrite needs a write query (INSERT, UPDATE or DELETE)";
+		return false;
+	}
+	PendingQuery pending;
+	pending.qry = Query{std::move(dbname), std::move(query_string), type};
+	pending.callback = [this](Query& qry){
+		if(qry.success){
+			++unwaited_writes.acknowledged;
+			return;
+		}
+		++unwaited_writes.failed;
+		Log("Fire-and-forget write to "+qry.dbname+" failed: "+qry.err,v_debug,verbosity);
+		if(write_error_callback) write_error_callback(qry);
+	};
+	pending.timeout = std::chrono::milliseconds(query_timeout);
+	pending.fail_fast = true;
+	
+	// counted first: once queued it may be acknowledged before Submit even returns
+	++unwaited_writes.submitted;
+	if(not Submit(std::move(pending), err)){
+		--unwaited_writes.submitted;
+		++unwaited_writes.rejected;
+		return false;
+	}
+	return true;
+}
+
+void PGClient::SetWriteErrorCallback(QueryCallback callback){
+	write_error_callback = std::move(callback);
+}
+
+void PGClient::SetReadCacheTTL(std::string dbname, std::string table, int ttl_ms){
+	if(read_cache) read_cache->SetTTL(dbname, table, std::chrono::milliseconds(ttl_ms));
+}
+
+ReadCache::Stats PGClient::GetReadCacheStats(){
+	if(read_cache) return read_cache->GetStats();
+	return ReadCache::Stats{0, 0, 0, 0, 0, 0, 0, 0};
+}
+
+PGClient::UnwaitedWriteStats PGClient::GetUnwaitedWriteStats(){
+	UnwaitedWriteStats stats;
+	stats.submitted = unwaited_writes.submitted.load();
+	stats.acknowledged = unwaited_writes.acknowledged.load();
+	stats.failed = unwaited_writes.failed.load();
+	stats.rejected = unwaited_writes.rejected.load();
+	return stats;
+}
+
+uint32_t PGClient::PrepareStatement(std::string dbname, std::string sql, std::string* err){
+	// register a statement to be executed with parameters ($1, $2...) by SubmitPrepared.
+	// Registering the same statement again returns the same id. Nothing is sent until it's used.
+	if(sql.empty()){
+		if(err) *err = "Empty prepared statement";
+		return 0;
 	}
+	std::string key = dbname+'\0'+sql;
+	std::lock_guard<std::mutex> lock(statements_mtx);
+	std::map<std::string, uint32_t>::iterator it = statement_ids.find(key);
+	if(it!=statement_ids.end()) return it->second;
+	PreparedStatement statement{std::move(dbname), std::move(sql), 'r', true};
+	statement.type = GetQueryType(statement.sql);
+	statement.shareable = not ReadCache::IsVolatile(statement.sql);
+	statements.push_back(std::move(statement));
+	uint32_t statement_id = statements.size();  // ids start at 1; 0 means a plain query
+	statement_ids.emplace(std::move(key), statement_id);
+	return statement_id;
+}
+
+std::string PGClient::GetStatementSQL(uint32_t statement_id){
+	std::lock_guard<std::mutex> lock(statements_mtx);
+	if(statement_id==0 || statement_id>statements.size()) return "";
+	return statements.at(statement_id-1).sql;
+}
+
+bool PGClient::SubmitPrepared(uint32_t statement_id, const QueryParams& params, QueryCallback callback, int* timeout_ms, std::string* err){
+	// execute a registered statement. Only its id and the encoded parameters are sent,
+	// so the middleman can reuse its prepared plan rather than parsing the SQL each time.
+	PendingQuery pending;
+	{
+		std::lock_guard<std::mutex> lock(statements_mtx);
+		if(statement_id==0 || statement_id>statements.size()){
+			if(err) *err = "Unknown prepared statement "+std::to_string(statement_id);
+			return false;
+		}
+		const PreparedStatement& statement = statements.at(statement_id-1);
+		pending.qry = Query{statement.dbname, "", statement.type};
+	}
+	pending.qry.statement_id = statement_id;
+	pending.qry.n_params = params.Size();
+	pending.qry.params = params.Encoded();
+	pending.callback = std::move(callback);
+	pending.timeout = std::chrono::milliseconds((timeout_ms) ? *timeout_ms : query_timeout);
 	
-	// if we succeeded in sending the message, we now need to wait for a repsonse.
-	// again, the next message received may not be for us, so a central dealer receives
-	// all responses and deals them out to the appropriate recipient.
-	// submit a ticket for our message id and wait for it to come up.
-	std::promise<Query> response_ticket;
-	std::future<Query> response_reciept = response_ticket.get_future();
-	waiting_recipients.emplace(thismsgid, std::move(response_ticket));
+	return Submit(std::move(pending), err);
+}
+
+bool PGClient::SendPrepared(uint32_t statement_id, const QueryParams& params, std::vector<std::string>* results, int* timeout_ms, std::string* err){
+	// blocking version of SubmitPrepared
+	int timeout=query_timeout;
+	if(timeout_ms) timeout=*timeout_ms;
+	
+	std::shared_ptr<std::promise<Query>> ticket = std::make_shared<std::promise<Query>>();
+	std::future<Query> response = ticket->get_future();
+	if(not SubmitPrepared(statement_id, params, [ticket](Query& qry){ ticket->set_value(std::move(qry)); }, &timeout, err)){
+		return false;
+	}
 	
-	// wait for our number to come up. loooong timeout, but don't hang forever.
-	if(response_reciept.wait_for(std::chrono::seconds(30))==std::future_status::timeout){
-		// timed out
-		if(qry.type=='w') ++write_queries_failed;
-		else if(qry.type=='r') ++read_queries_failed;
-		Log("Timed out waiting for response for query "+std::to_string(thismsgid),v_warning,verbosity);
-		qry.success = false;
-		qry.err = "Timed out waiting for response";
-		return qry;
-	} else {
-		std::cout<<"PGClient got a response for query "<<qry.msg_id<<std::endl;
-		// got a response!
-		return response_reciept.get();
+	if(response.wait_for(std::chrono::milliseconds(timeout))!=std::future_status::timeout){
+		Query qry = response.get();
+		if(results) qry.query_response.CopyTo(*results);
+		if(err) *err = qry.err;
+		return qry.success;
+	}
+	std::string errmsg="Timed out after waiting "+std::to_string(timeout)+"ms for response "
+	                   "from prepared statement "+std::to_string(statement_id);
+	if(verbosity>3) std::cerr<<errmsg<<std::endl;
+	if(err) *err=errmsg;
+	return false;
+}
+
+uint32_t PGClient::RegisterLookup(std::string dbname, std::string sql, std::string* err){
+	// register a point lookup "SELECT <expression> FROM <tables> WHERE <key column> = $1"
+	// for SubmitLookup. Registering the same lookup again returns the same id.
+	std::string key = dbname+'\0'+sql;
+	{
+		std::lock_guard<std::mutex> lock(lookups_mtx);
+		std::map<std::string, uint32_t>::iterator it = lookup_ids.find(key);
+		if(it!=lookup_ids.end()) return it->second;
 	}
 	
-	return qry;  // dummy
+	// find the SELECT, FROM and WHERE keywords, ignoring any in quotes or brackets
+	std::string upper = sql;
+	std::transform(upper.begin(), upper.end(), upper.begin(), [](unsigned char c){ return std::toupper(c); });
+	size_t select_pos = std::string::npos, from_pos = std::string::npos, where_pos = std::string::npos;
+	char quote = 0;
+	int depth = 0;
+	for(size_t i=0; i<upper.size(); ++i){
+		char c = upper[i];
+		if(quote!=0){
+			if(c==quote) quote = 0;
+			continue;
+		}
+		if(c=='\'' || c=='"') quote = c;
+		else if(c=='(') ++depth;
+		else if(c==')') --depth;
+		if(depth!=0 || (i>0 && not std::isspace((unsigned char)upper[i-1]))) continue;
+		if(upper.compare(i, 7, "SELECT ")==0 && select_pos==std::string::npos) select_pos = i;
+		else if(upper.compare(i, 5, "FROM ")==0 && from_pos==std::string::npos) from_pos = i;
+		else if(upper.compare(i, 6, "WHERE ")==0 && where_pos==std::string::npos) where_pos = i;
+	}
+	if(select_pos!=upper.find_first_not_of(" \t\n") || from_pos==std::string::npos ||
+	   where_pos==std::string::npos || not (select_pos<from_pos && from_pos<where_pos)){
+		if(err) *err = "Lookup must be of the form SELECT <expression> FROM <tables> WHERE <key column> = $1";
+		return 0;
+	}
+	// the condition must be just the key
+	std::string condition = sql.substr(where_pos+6);
+	while(not condition.empty() && (std::isspace((unsigned char)condition.back()) || condition.back()==';')) condition.pop_back();
+	size_t equals = condition.find('=');
+	if(equals==std::string::npos || condition.compare(condition.find_first_not_of(" \t\n", equals+1), std::string::npos, "$1")!=0){
+		if(err) *err = "Lookup condition must be <key column> = $1";
+		return 0;
+	}
+	auto trim = [](std::string str){
+		size_t start = str.find_first_not_of(" \t\n");
+		if(start==std::string::npos) return std::string();
+		return str.substr(start, str.find_last_not_of(" \t\n")-start+1);
+	};
+	LookupTemplate lookup{dbname, trim(sql.substr(select_pos+7, from_pos-select_pos-7)),
+	                      trim(sql.substr(from_pos+5, where_pos-from_pos-5)), trim(condition.substr(0, equals))};
+	if(lookup.expression.empty() || lookup.expression=="*" || lookup.tables.empty() || lookup.key_column.empty()){
+		if(err) *err = "Lookup must select a single expression, from named tables, by a key column";
+		return 0;
+	}
 	
+	std::lock_guard<std::mutex> lock(lookups_mtx);
+	std::map<std::string, uint32_t>::iterator it = lookup_ids.find(key);
+	if(it!=lookup_ids.end()) return it->second;
+	lookups.push_back(std::move(lookup));
+	uint32_t lookup_id = lookups.size();
+	lookup_ids.emplace(std::move(key), lookup_id);
+	return lookup_id;
 }
 
-bool PGClient::GetNextRespose(){
-	// get any new messages from middleman, and notify the client of the outcome
+bool PGClient::SubmitLookup(uint32_t lookup_id, std::string key, QueryCallback callback, int* timeout_ms, std::string* err){
+	// look up one key. It's held briefly by the background thread to be sent along with
+	// lookups of other keys, then the callback is given the rows for this key.
+	PendingQuery pending;
+	{
+		std::lock_guard<std::mutex> lock(lookups_mtx);
+		if(lookup_id==0 || lookup_id>lookups.size()){
+			if(err) *err = "Unknown lookup "+std::to_string(lookup_id);
+			return false;
+		}
+		pending.qry = Query{lookups.at(lookup_id-1).dbname, "", 'r'};
+	}
+	pending.lookup_id = lookup_id;
+	pending.lookup_key = std::move(key);
+	pending.callback = std::move(callback);
+	pending.timeout = std::chrono::milliseconds((timeout_ms) ? *timeout_ms : query_timeout);
 	
-	std::vector<zmq::message_t> response;
-	int ret = PollAndReceive(clt_dlr_socket, in_polls.at(0), inpoll_timeout, response);
-	//std::cout<<"PGClient: GNR returned "<<ret<<std::endl;
+	return Submit(std::move(pending), err);
+}
+
+bool PGClient::SendLookup(uint32_t lookup_id, std::string key, std::vector<std::string>* results, int* timeout_ms, std::string* err){
+	// blocking version of SubmitLookup
+	int timeout=query_timeout;
+	if(timeout_ms) timeout=*timeout_ms;
+	
+	std::shared_ptr<std::promise<Query>> ticket = std::make_shared<std::promise<Query>>();
+	std::future<Query> response = ticket->get_future();
+	if(not SubmitLookup(lookup_id, key, [ticket](Query& qry){ ticket->set_value(std::move(qry)); }, &timeout, err)){
+		return false;
+	}
 	
-	// check return status
-	if(ret==-2) return true;      // no messages waiting to be received
+	if(response.wait_for(std::chrono::milliseconds(timeout))!=std::future_status::timeout){
+		Query qry = response.get();
+		if(results) qry.query_response.CopyTo(*results);
+		if(err) *err = qry.err;
+		return qry.success;
+	}
+	std::string errmsg="Timed out after waiting "+std::to_string(timeout)+"ms for response "
+	                   "from lookup "+std::to_string(lookup_id)+" of '"+key+"'";
+	if(verbosity>3) std::cerr<<errmsg<<std::endl;
+	if(err) *err=errmsg;
+	return false;
+}
+
+bool PGClient::Submit(PendingQuery&& pending, std::string* err){
+	// hand a query to the background thread for sending
+	
+	// drop cached reads of the table this writes to. It's done again once the write is
+	// acknowledged, in case a read caches the old rows in the meantime.
+	// The table is also needed for the write's topic, if those include it.
+	if((read_cache || write_topics==2) && pending.qry.type=='w'){
+		pending.cache_key = ReadCache::WriteTable((pending.qry.statement_id==0) ? pending.qry.query_string : GetStatementSQL(pending.qry.statement_id));
+		if(read_cache) read_cache->Invalidate(pending.qry.dbname, pending.cache_key);
+	}
 	
-	if(ret==-3){
-		Log("PollAndReceive Error polling in socket! Is socket closed?",v_error,verbosity);
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	pending.qry.times.submitted = now;
+	pending.deadline = now + pending.timeout;
+	
+	// apply backpressure if too many queries are already outstanding
+	std::chrono::steady_clock::time_point wait_until = now;
+	if(backpressure_timeout_ms<0) wait_until = pending.deadline;
+	else if(backpressure_timeout_ms>0) wait_until = std::min(pending.deadline, now+std::chrono::milliseconds(backpressure_timeout_ms));
+	// never wait on the background thread (e.g. a callback submitting a follow-up query),
+	// since that's the thread that makes room
+	if(std::this_thread::get_id()==background_thread.get_id()) wait_until = now;
+	if(pending.fail_fast) wait_until = now;
+	bool have_room = (wait_until<=now) ? in_flight_window->TryAcquire(pending.qry.type)
+	                                   : in_flight_window->Acquire(pending.qry.type, wait_until);
+	if(not have_room){
+		if(pending.qry.type=='w') ++write_queries_failed;
+		else if(pending.qry.type=='r') ++read_queries_failed;
+		Log("Too many queries in flight, rejecting query",v_debug,verbosity);
+		if(err) *err = "Too many queries in flight";
 		return false;
 	}
 	
-	if(response.size()==0){
-		Log("PollAndReceive recieved empty response!",v_error,verbosity);
+	// zmq sockets aren't thread-safe, so we have one central sender.
+	pending.bytes = pending.qry.query_string.size() + pending.qry.params.size();
+	bytes_in_flight += pending.bytes;
+	if(not waiting_senders->TryPush(std::move(pending))){
+		// queue is full; fail fast rather than letting it grow without limit
+		bytes_in_flight -= pending.bytes;
+		in_flight_window->Release(pending.qry.type);
+		if(pending.qry.type=='w') ++write_queries_failed;
+		else if(pending.qry.type=='r') ++read_queries_failed;
+		Log("Submission queue full, dropping query",v_warning,verbosity);
+		if(err) *err = "Submission queue full";
 		return false;
 	}
+	Wake();
+	
+	return true;
+}
+
+char PGClient::GetQueryType(const std::string& query_string){
+	// we need to send reads and writes to different sockets.
+	// we could ask the user to specify, or try to determine it ourselves
+	bool is_write_txn = (query_string.find("INSERT")!=std::string::npos) ||
+	                    (query_string.find("UPDATE")!=std::string::npos) ||
+	                    (query_string.find("DELETE")!=std::string::npos);
+	return (is_write_txn) ? 'w' : 'r';
+}
+
+std::string PGClient::GetInsertTable(const std::string& query_string){
+	// the table written to by a plain "INSERT INTO table ..." statement, or "" for anything else.
+	// Only such statements are batched, since they return nothing but an acknowledgement.
+	size_t pos = query_string.find_first_not_of(" \t\n");
+	if(pos==std::string::npos || query_string.compare(pos, 6, "INSERT")!=0) return "";
+	pos = query_string.find_first_not_of(" \t\n", pos+6);
+	if(pos==std::string::npos || query_string.compare(pos, 4, "INTO")!=0) return "";
+	pos = query_string.find_first_not_of(" \t\n", pos+4);
+	if(pos==std::string::npos) return "";
+	size_t end = query_string.find_first_of(" \t\n(", pos);
+	if(end==std::string::npos) return "";
+	// multiple statements, or ones returning rows, must go on their own
+	if(query_string.find(';')<query_string.size()-1) return "";
+	if(query_string.find("RETURNING")!=std::string::npos) return "";
+	return query_string.substr(pos, end-pos);
+}
+
+void PGClient::Deliver(PendingQuery& pending){
+	// hand a finished (or failed) query back to whoever submitted it, making room for another
+	ReleasePeers(pending);
+	if(pending.batch && pending.lookup_id!=0){
+		DeliverLookups(pending);
+		return;
+	}
+	if(pending.batch){
+		// a batched write; give each of its queries their own outcome. The acknowledgement
+		// of a batch carries one row per query, empty on success or holding that query's error.
+		const ResultSet& acks = pending.qry.query_response;
+		bool per_query = (acks.size()==pending.batch->size());
+		for(size_t i=0; i<pending.batch->size(); ++i){
+			Query& qry = pending.batch->at(i).qry;
+			qry.msg_id = pending.qry.msg_id;
+			if(per_query){
+				qry.success = acks[i].empty();
+				qry.err = acks.String(i);
+			} else {
+				qry.success = pending.qry.success;
+				qry.err = pending.qry.err;
+			}
+			pending.batch->at(i).qry.times.sent = pending.qry.times.sent;
+			pending.batch->at(i).qry.times.received = pending.qry.times.received;
+			Deliver(pending.batch->at(i));
+		}
+		return;
+	}
+	in_flight_window->Release(pending.qry.type);
+	bytes_in_flight -= pending.bytes;
+	pending.qry.times.delivered = std::chrono::steady_clock::now();
+	RecordLatency(pending);
+	if(flight_recorder) RecordFlight(pending);
+	if(read_cache && pending.qry.type=='w') read_cache->Invalidate(pending.qry.dbname, pending.cache_key);
+	// nor those made after it's acknowledged share one sent before then
+	if(pending.qry.type=='w') ++write_epochs[pending.qry.dbname];
+	if(pending.flight_hash!=0){
+		// no longer in flight, so later identical reads must be sent again
+		std::unordered_map<size_t, uint32_t>::iterator it = reads_in_flight.find(pending.flight_hash);
+		if(it!=reads_in_flight.end() && it->second==pending.qry.msg_id) reads_in_flight.erase(it);
+	}
+	if(pending.followers){
+		// identical reads that joined this one share its result. The rows are shared, not copied.
+		// If it timed out, any with time left are sent again rather than failed early.
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		for(PendingQuery& follower : *pending.followers){
+			if(pending.timed_out && follower.deadline>now){
+				if(not JoinRead(follower)) DispatchQuery(follower, 0);
+				continue;
+			}
+			follower.qry.success = pending.qry.success;
+			follower.qry.err = pending.qry.err;
+			follower.qry.msg_id = pending.qry.msg_id;
+			follower.qry.query_response = pending.qry.query_response;
+			follower.qry.times.sent = std::max(pending.qry.times.sent, follower.qry.times.submitted);
+			follower.qry.times.received = pending.qry.times.received;
+			Deliver(follower);
+		}
+		pending.followers.reset();
+	}
+	if(not pending.qry.success){
+		if(pending.qry.type=='w') ++write_queries_failed;
+		else if(pending.qry.type=='r') ++read_queries_failed;
+	}
+	if(not pending.callback) return;
+	// callbacks run on the background thread; don't let a misbehaving one take it down
+	try {
+		pending.callback(pending.qry);
+	} catch(std::exception& e){
+		Log(std::string("Exception in query callback: ")+e.what(),v_error,verbosity);
+	} catch(...){
+		Log("Unknown exception in query callback",v_error,verbosity);
+	}
+}
+
+void PGClient::RecordLatency(const PendingQuery& pending){
+	// add a completed query to the latency histograms for its type and database.
+	// Only the background thread does this, so each histogram has a single writer.
+	const QueryTimes& times = pending.qry.times;
+	if(times.submitted==std::chrono::steady_clock::time_point()) return;
+	std::string key = pending.qry.type+pending.qry.dbname;
+	std::unordered_map<std::string, LatencyStats*>::iterator it = latency_stats.find(key);
+	if(it==latency_stats.end()){
+		LatencyStats* stats = new LatencyStats;
+		stats->type = pending.qry.type;
+		stats->dbname = pending.qry.dbname;
+		std::lock_guard<std::mutex> lock(latency_stats_mtx);
+		it = latency_stats.emplace(key, stats).first;
+	}
+	LatencyStats& stats = *it->second;
+	if(not pending.qry.success){
+		++stats.failed;
+		return;
+	}
+	if(times.sent!=std::chrono::steady_clock::time_point()){
+		stats.queued.Record(std::chrono::duration_cast<std::chrono::microseconds>(times.sent-times.submitted).count());
+		stats.awaiting.Record(std::chrono::duration_cast<std::chrono::microseconds>(times.delivered-times.sent).count());
+	}
+	stats.total.Record(std::chrono::duration_cast<std::chrono::microseconds>(times.delivered-times.submitted).count());
+}
+
+void PGClient::RecordFlight(const PendingQuery& pending){
+	// keep a completed query's timings in the flight recorder
+	FlightRecorder::Entry& entry = flight_recorder->Next();
+	const Query& qry = pending.qry;
+	entry.msg_id = qry.msg_id;
+	entry.type = qry.type;
+	entry.success = qry.success;
+	entry.timed_out = pending.timed_out;
+	entry.retries = pending.retries;
+	entry.peer = pending.peer;
+	entry.statement_id = qry.statement_id;
+	FlightRecorder::Copy(entry.dbname, qry.dbname);
+	FlightRecorder::Copy(entry.query, qry.query_string);
+	entry.submitted = qry.times.submitted;
+	entry.dequeued = qry.times.dequeued;
+	entry.sent = qry.times.sent;
+	entry.received = qry.times.received;
+	entry.delivered = qry.times.delivered;
+	flight_recorder->Commit();
+}
+
+std::string PGClient::DumpFlightRecorder(){
+	// the recent queries in the flight recorder, oldest first, one per line. Times are from
+	// when each was submitted, in microseconds; '-' for stages it didn't reach.
+	if(flight_recorder==nullptr) return "";
+	std::vector<FlightRecorder::Entry> entries = flight_recorder->Dump();
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::ostringstream out;
+	for(const FlightRecorder::Entry& entry : entries){
+		auto since_submitted = [&entry](std::chrono::steady_clock::time_point when){
+			if(when==std::chrono::steady_clock::time_point()) return std::string("-");
+			return std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(when-entry.submitted).count());
+		};
+		out<<"query "<<entry.msg_id<<" "<<entry.type<<" "<<entry.dbname<<" "
+		   <<(entry.timed_out ? "timed out" : (entry.success ? "ok" : "failed"))
+		   <<" "<<std::chrono::duration_cast<std::chrono::milliseconds>(now-entry.delivered).count()<<"ms ago:"
+		   <<" dequeued "<<since_submitted(entry.dequeued)<<" sent "<<since_submitted(entry.sent)
+		   <<" received "<<since_submitted(entry.received)<<" delivered "<<since_submitted(entry.delivered)<<"us";
+		if(entry.retries) out<<", "<<(int)entry.retries<<" retries";
+		if(entry.peer>=0) out<<", middleman "<<entry.peer;
+		if(entry.statement_id) out<<", statement "<<entry.statement_id;
+		else out<<", '"<<entry.query<<"'";
+		out<<"\n";
+	}
+	return out.str();
+}
+
+void PGClient::PrintStats(boost::posix_time::ptime now){
+	// log the throughput and latency percentiles of each query type and database since the last printout
+	double seconds = (now-last_printout).total_microseconds()/1e6;
+	last_printout = now;
+	auto percentiles = [](const LatencyHistogram::Snapshot& snapshot){
+		return std::to_string(snapshot.Percentile(0.5))+"/"+std::to_string(snapshot.Percentile(0.99))+"/"+
+		       std::to_string(snapshot.Percentile(0.999))+"us";
+	};
+	for(std::pair<const std::string, LatencyStats*>& entry : latency_stats){
+		LatencyStats& stats = *entry.second;
+		LatencyHistogram::Snapshot queued = stats.queued.Take();
+		LatencyHistogram::Snapshot awaiting = stats.awaiting.Take();
+		LatencyHistogram::Snapshot total = stats.total.Take();
+		long failed = stats.failed.load();
+		LatencyHistogram::Snapshot period_total = total.Since(stats.last_total);
+		uint64_t completed = period_total.Count();
+		if(completed>0 || failed>stats.last_failed){
+			char rate[32];
+			snprintf(rate, sizeof(rate), "%.1f", completed/seconds);
+			Log("PGClient stats: "+std::string(1,stats.type)+" "+stats.dbname+": "+rate+"/s, "+
+			    std::to_string(failed-stats.last_failed)+" failed; p50/p99/p999 queued "+
+			    percentiles(queued.Since(stats.last_queued))+", awaiting response "+
+			    percentiles(awaiting.Since(stats.last_awaiting))+", total "+percentiles(period_total),
+			    v_message,verbosity);
+		}
+		stats.last_queued = queued;
+		stats.last_awaiting = awaiting;
+		stats.last_total = total;
+		stats.last_failed = failed;
+	}
+}
+
+bool PGClient::ServeMetrics(){
+	// answer each request on the metrics socket (whatever it says) with the current metrics.
+	// Requests arrive as [requester identity][empty delimiter][request...], and the reply goes
+	// back with the same envelope. This runs on the background thread, so nothing is let throw.
+	for(int requests=0; requests<receive_batch_size; ++requests){
+		std::vector<zmq::message_t> request;
+		try {
+			Receive(clt_metrics_socket, request, ZMQ_DONTWAIT);
+			if(request.empty()) break;
+			size_t delimiter = 0;
+			while(delimiter<request.size() && request.at(delimiter).size()>0) ++delimiter;
+			if(delimiter==request.size()) continue;   // not from a REQ socket
+			request.erase(request.begin()+delimiter+1, request.end());
+			if(not Send(clt_metrics_socket, true, request) || not Send(clt_metrics_socket, false, GetMetrics())){
+				Log("Failed to send metrics",v_warning,verbosity);
+			}
+		} catch(zmq::error_t& e){
+			Log(std::string("Error serving metrics: ")+e.what(),v_warning,verbosity);
+			return false;
+		}
+	}
+	return true;
+}
+
+std::string PGClient::GetMetrics(){
+	// the client's counters and gauges in the Prometheus text exposition format
+	std::ostringstream out;
+	auto metric = [&out](const std::string& name, const std::string& type, const std::string& help){
+		out<<"# HELP "<<name<<" "<<help<<"\n# TYPE "<<name<<" "<<type<<"\n";
+	};
+	auto label = [](std::string value){
+		std::string escaped;
+		for(char c : value){
+			if(c=='\\' || c=='"') escaped += '\\';
+			if(c=='\n') escaped += "\\n";
+			else escaped += c;
+		}
+		return escaped;
+	};
+	auto type_name = [](char type){ return (type=='w') ? "write" : "read"; };
+	
+	metric("pgclient_queries_queued", "gauge", "Queries submitted and waiting to be sent");
+	out<<"pgclient_queries_queued "<<waiting_senders->Size()<<"\n";
+	metric("pgclient_queries_awaiting_response", "gauge", "Messages sent and awaiting a response");
+	out<<"pgclient_queries_awaiting_response "<<waiting_recipients->InFlight()<<"\n";
+	metric("pgclient_queries_in_flight", "gauge", "Queries submitted and not yet completed");
+	out<<"pgclient_queries_in_flight{type=\"read\"} "<<in_flight_window->InFlight('r')<<"\n";
+	out<<"pgclient_queries_in_flight{type=\"write\"} "<<in_flight_window->InFlight('w')<<"\n";
+	metric("pgclient_queries_in_flight_limit", "gauge", "Most queries that may be in flight at once (max_in_flight)");
+	out<<"pgclient_queries_in_flight_limit "<<in_flight_window->Max()<<"\n";
+	metric("pgclient_bytes_in_flight", "gauge", "Bytes of SQL and parameters of queries in flight");
+	out<<"pgclient_bytes_in_flight "<<bytes_in_flight.load()<<"\n";
+	
+	metric("pgclient_queries_failed_total", "counter", "Queries that failed, including timeouts");
+	out<<"pgclient_queries_failed_total{type=\"read\"} "<<read_queries_failed.load()<<"\n";
+	out<<"pgclient_queries_failed_total{type=\"write\"} "<<write_queries_failed.load()<<"\n";
+	metric("pgclient_queries_timed_out_total", "counter", "Messages with no response before their deadline");
+	out<<"pgclient_queries_timed_out_total "<<queries_timed_out.load()<<"\n";
+	metric("pgclient_queries_resent_total", "counter", "Times messages were sent again for lack of a response");
+	out<<"pgclient_queries_resent_total "<<queries_resent.load()<<"\n";
+	metric("pgclient_reads_hedged_total", "counter", "Slow reads also sent to another middleman");
+	out<<"pgclient_reads_hedged_total "<<reads_hedged.load()<<"\n";
+	metric("pgclient_reads_coalesced_total", "counter", "Reads answered by an identical read already in flight");
+	out<<"pgclient_reads_coalesced_total "<<reads_coalesced.load()<<"\n";
+	metric("pgclient_unwaited_writes_total", "counter", "Fire-and-forget writes, by outcome");
+	out<<"pgclient_unwaited_writes_total{outcome=\"submitted\"} "<<unwaited_writes.submitted.load()<<"\n";
+	out<<"pgclient_unwaited_writes_total{outcome=\"acknowledged\"} "<<unwaited_writes.acknowledged.load()<<"\n";
+	out<<"pgclient_unwaited_writes_total{outcome=\"failed\"} "<<unwaited_writes.failed.load()<<"\n";
+	out<<"pgclient_unwaited_writes_total{outcome=\"rejected\"} "<<unwaited_writes.rejected.load()<<"\n";
+	if(read_cache){
+		ReadCache::Stats cache = read_cache->GetStats();
+		metric("pgclient_read_cache_lookups_total", "counter", "Reads looked up in the result cache");
+		out<<"pgclient_read_cache_lookups_total{result=\"hit\"} "<<cache.hits<<"\n";
+		out<<"pgclient_read_cache_lookups_total{result=\"miss\"} "<<cache.misses<<"\n";
+		metric("pgclient_read_cache_bytes", "gauge", "Memory held by the read result cache");
+		out<<"pgclient_read_cache_bytes "<<cache.bytes<<"\n";
+	}
+	
+	std::vector<PeerSelector::PeerStats> peer_stats = GetPeerStats();
+	if(not peer_stats.empty()){
+		// middlemen are identified by their zmq identity, in hex
+		std::vector<std::string> ids;
+		for(const PeerSelector::PeerStats& peer : peer_stats){
+			std::string id;
+			char hex[3];
+			for(unsigned char c : peer.identity){
+				snprintf(hex, sizeof(hex), "%02x", c);
+				id += hex;
+			}
+			ids.push_back(id);
+		}
+		metric("pgclient_peer_rtt_microseconds", "gauge", "Moving average round trip time of reads to each middleman");
+		for(size_t i=0; i<peer_stats.size(); ++i) out<<"pgclient_peer_rtt_microseconds{peer=\""<<ids[i]<<"\"} "<<peer_stats[i].rtt_us<<"\n";
+		metric("pgclient_peer_outstanding", "gauge", "Reads sent to each middleman and not yet answered");
+		for(size_t i=0; i<peer_stats.size(); ++i) out<<"pgclient_peer_outstanding{peer=\""<<ids[i]<<"\"} "<<peer_stats[i].outstanding<<"\n";
+		metric("pgclient_peer_sent_total", "counter", "Reads sent to each middleman");
+		for(size_t i=0; i<peer_stats.size(); ++i) out<<"pgclient_peer_sent_total{peer=\""<<ids[i]<<"\"} "<<peer_stats[i].sent<<"\n";
+		metric("pgclient_peer_connected", "gauge", "Whether each middleman is connected");
+		for(size_t i=0; i<peer_stats.size(); ++i) out<<"pgclient_peer_connected{peer=\""<<ids[i]<<"\"} "<<peer_stats[i].connected<<"\n";
+	}
+	
+	// latencies since startup, as summaries
+	std::lock_guard<std::mutex> lock(latency_stats_mtx);
+	if(latency_stats.empty()) return out.str();
+	metric("pgclient_query_latency_microseconds", "summary", "Latency of successful queries: queued to be sent, awaiting the response, and in total");
+	for(std::pair<const std::string, LatencyStats*>& entry : latency_stats){
+		LatencyStats& stats = *entry.second;
+		std::string labels = "type=\""+std::string(type_name(stats.type))+"\",database=\""+label(stats.dbname)+"\",stage=\"";
+		std::pair<const char*, LatencyHistogram*> stages[] = {{"queued", &stats.queued}, {"awaiting", &stats.awaiting}, {"total", &stats.total}};
+		for(std::pair<const char*, LatencyHistogram*>& stage : stages){
+			LatencyHistogram::Snapshot snapshot = stage.second->Take();
+			std::string stage_labels = labels+stage.first+"\"";
+			for(double q : {0.5, 0.9, 0.99, 0.999}){
+				out<<"pgclient_query_latency_microseconds{"<<stage_labels<<",quantile=\""<<q<<"\"} "<<snapshot.Percentile(q)<<"\n";
+			}
+			out<<"pgclient_query_latency_microseconds_sum{"<<stage_labels<<"} "<<snapshot.sum<<"\n";
+			out<<"pgclient_query_latency_microseconds_count{"<<stage_labels<<"} "<<snapshot.Count()<<"\n";
+		}
+	}
+	metric("pgclient_queries_failed_by_database_total", "counter", "Queries that failed, by type and database");
+	for(std::pair<const std::string, LatencyStats*>& entry : latency_stats){
+		LatencyStats& stats = *entry.second;
+		out<<"pgclient_queries_failed_by_database_total{type=\""<<type_name(stats.type)<<"\",database=\""<<label(stats.dbname)<<"\"} "<<stats.failed.load()<<"\n";
+	}
+	
+	return out.str();
+}
+
+void PGClient::DeliverLookups(PendingQuery& pending){
+	// a batch of lookups. Each row is "<key length>:<key><value>" (see DispatchLookups);
+	// give each lookup the values for its key. Rows that don't parse are dropped.
+	std::unordered_map<std::string, std::vector<zmq::message_t>> rows_by_key;
+	const ResultSet& rows = pending.qry.query_response;
+	for(size_t i=0; i<rows.size(); ++i){
+		boost::string_view row = rows[i];
+		size_t colon = row.find(':');
+		if(colon==boost::string_view::npos || colon==0 || colon>10) continue;
+		size_t key_length = 0;
+		bool valid = true;
+		for(size_t pos=0; pos<colon; ++pos){
+			if(row[pos]<'0' || row[pos]>'9') valid = false;
+			key_length = key_length*10+(row[pos]-'0');
+		}
+		if(not valid || key_length>row.size()-colon-1) continue;
+		size_t value_pos = colon+1+key_length;
+		std::vector<zmq::message_t>& values = rows_by_key[std::string(row.data()+colon+1, key_length)];
+		values.emplace_back(row.size()-value_pos);
+		memcpy(values.back().data(), row.data()+value_pos, row.size()-value_pos);
+	}
+	// lookups of the same key share their rows
+	std::unordered_map<std::string, ResultSet> results;
+	for(std::pair<const std::string, std::vector<zmq::message_t>>& key_rows : rows_by_key){
+		results.emplace(key_rows.first, ResultSet(std::move(key_rows.second), 0));
+	}
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	for(PendingQuery& member : *pending.batch){
+		if(pending.timed_out && member.deadline>now){
+			// the combined query timed out before this lookup would have; try it again
+			lookup_batcher->Add(std::to_string(member.lookup_id), std::move(member), now);
+			continue;
+		}
+		Query& qry = member.qry;
+		qry.msg_id = pending.qry.msg_id;
+		qry.success = pending.qry.success;
+		qry.err = pending.qry.err;
+		std::unordered_map<std::string, ResultSet>::iterator it = results.find(member.lookup_key);
+		if(it!=results.end()) qry.query_response = it->second;
+		qry.times.sent = pending.qry.times.sent;
+		qry.times.received = pending.qry.times.received;
+		Deliver(member);
+	}
+}
+
+bool PGClient::CheckTimeouts(){
+	// fail any queries whose deadline has passed without a response.
+	// Entries for queries that have since completed simply fail to cancel.
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	while(not deadlines.empty() && deadlines.top().first<=now){
+		uint32_t thismsgid = deadlines.top().second;
+		deadlines.pop();
+		PendingQuery* waiting = waiting_recipients->Find(thismsgid);
+		if(waiting && waiting->deadline>now){
+			// not timed out yet: streaming queries push back their deadline each time a chunk
+			// arrives, and queries still awaiting a response may be due to be sent again
+			if(waiting->retries<Retries(*waiting) && waiting->resend_at<=now) Resend(thismsgid, *waiting);
+			else if(waiting->hedge_at!=std::chrono::steady_clock::time_point() && waiting->hedge_at<=now) Hedge(thismsgid, *waiting);
+			deadlines.emplace(NextCheck(*waiting), thismsgid);
+			continue;
+		}
+		PendingQuery pending;
+		if(not waiting_recipients->Cancel(thismsgid, pending)) continue;
+		// timed out. Our slot is released, so any late response will be dropped.
+		const QueryTimes& times = pending.qry.times;
+		Log("Timed out waiting for response for query "+std::to_string(thismsgid)+" (sent "+
+		    std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(now-times.sent).count())+"ms ago, "+
+		    std::to_string(pending.retries)+" retries)",v_warning,verbosity);
+		if(pending.peer>=0 && pending.retries==0) peers->RecordRTT(pending.peer, now-times.sent);
+		pending.qry.success = false;
+		pending.qry.err = "Timed out waiting for response";
+		pending.timed_out = true;
+		++queries_timed_out;
+		Deliver(pending);
+		// log what led up to it, though not for every timeout if many queries time out together
+		if(flight_recorder && flight_dump_period.count()>0 && now>=next_flight_dump){
+			Log("Recent queries, up to the timeout of query "+std::to_string(thismsgid)+":\n"+DumpFlightRecorder(),v_warning,verbosity);
+			next_flight_dump = now + flight_dump_period;
+		}
+	}
+	return true;
+}
+
+bool PGClient::GetNextRespose(){
+	// get any new messages from middleman, and notify the client of the outcome.
+	// The background thread has already polled the socket, so don't wait here,
+	// but drain everything that's ready (up to receive_batch_size) so one wakeup handles a burst.
+	
+	for(int received=0; received<receive_batch_size; ++received){
+		std::vector<zmq::message_t> response;
+		get_ok = Receive(clt_dlr_socket, response, ZMQ_DONTWAIT);
+		
+		// check return status
+		if(response.size()==0) break;   // no more messages waiting to be received
+		
+		// a router socket prefixes the identity of the middleman it came from
+		int peer = -1;
+		if(peers){
+			std::string identity(static_cast<char*>(response.at(0).data()), response.at(0).size());
+			size_t known = peers->Connected();
+			peer = peers->Add(identity);
+			if(peers->Connected()!=known) Log("Middleman connected on read socket",v_message,verbosity);
+			response.erase(response.begin());
+		}
+		// an empty message is a middleman announcing itself as it connects
+		if(response.empty() || response.at(0).size()==0) continue;
+		
+		// return of false with some parts received means the last zmq message had the 'more' flag set
+		HandleResponse(response, (get_ok) ? 0 : -1, peer);
+	}
+	
+	return true;
+}
+
+bool PGClient::HandleResponse(std::vector<zmq::message_t>& response, int ret, int peer){
+	// match a received response to the query it answers, and notify the client of the outcome
 	
 	// received message may be an acknowledgement of a write, or the result of a read.
 	// messages are 2+ zmq parts as follows:
 	// 1. the message ID, used by the client to match to the message it sent
 	// 2. the response code, to signal errors
 	// 3.... the SQL query results, if any. Each row is returned in a new message part.
-	Query qry;
+	
+	// if we got this far we had at least one response part; the message id.
+	// get the query associated with this message id, releasing its slot
+	uint32_t message_id_rcvd = *reinterpret_cast<uint32_t*>(response.at(0).data());
+	int status = (response.size()>1) ? *reinterpret_cast<int*>(response.at(1).data()) : 0;
+	
+	// statements are only sent compressed once a middleman has shown it can decompress them
+	if(ret==0 && (status & RESP_ACCEPTS_COMPRESSED) && not middleman_decompresses){
+		Log("Middleman accepts compressed frames, compressing large statements",v_message,verbosity);
+		middleman_decompresses = true;
+	}
+	
+	// one chunk of a streaming read; the query remains pending until the final chunk
+	if(ret==0 && (status & RESP_MORE)) return HandleChunk(message_id_rcvd, response, peer);
+	
+	PendingQuery pending;
+	if(not waiting_recipients->Complete(message_id_rcvd, pending)){
+		// unknown message id, a late response to a query that has already timed out,
+		// or the slower response to a query that was resent or hedged
+		Log("Unknown or stale message id "+std::to_string(message_id_rcvd)+" with no client; dropping",v_debug,verbosity);
+		return false;
+	}
+	Query& qry = pending.qry;
+	qry.times.received = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::duration latency = qry.times.received-qry.times.sent;
+	if(hedge_reads && qry.type=='r' && not pending.on_rows) RecordReadLatency(latency);
+	// the middleman it was sent to took this long, or longer if another answered first
+	if(pending.peer>=0 && pending.retries==0 && not pending.on_rows) peers->RecordRTT(pending.peer, latency);
+	
+	// the middleman hasn't prepared this statement yet; send it again along with the SQL
+	if(ret==0 && (status & RESP_UNKNOWN_STATEMENT) && qry.statement_id!=0 && not pending.send_statement){
+		Log("Middleman requested SQL for prepared statement "+std::to_string(qry.statement_id),v_debug,verbosity);
+		pending.send_statement = true;
+		ReleasePeers(pending);
+		DispatchQuery(pending, 0);
+		return true;
+	}
+	
 	if(ret==-1 || response.size()<2){
 		// return of -1 suggests the last zmq message had the 'more' flag set
 		// suggesting there should have been more parts, but they never came.
@@ -466,73 +1483,649 @@ bool PGClient::GetNextRespose(){
 	}
 	// else if ret==0 && response.size() >= 2: success
 	
-	// if we got this far we had at least one response part; the message id
-	int message_id_rcvd = *reinterpret_cast<int*>(response.at(0).data());
-	
 	// if we also had a status part, get that
 	if(response.size()>1){
-		qry.success = *reinterpret_cast<int*>(response.at(1).data());  // (0 or 1 for now)
+		qry.success = status & RESP_STATUS_MASK;  // (0 or 1 for now)
+	}
+	// if we also had further parts, those are the rows. Keep them in the frames they arrived in;
+	// they're only decoded if and when the client accesses them.
+	if(response.size()>2){
+		qry.query_response = ResultSet(std::move(response), 2);
 	}
-	// if we also had further parts, fetch those
-	for(int i=2; i<response.size(); ++i){
-		qry.query_response.push_back(std::string(reinterpret_cast<const char*>(response.at(i).data())));
+	// the last chunk of a streaming read goes to the row consumer like the others
+	if(pending.on_rows){
+		if(not qry.query_response.empty()) ConsumeRows(pending, qry.query_response);
+		qry.query_response = ResultSet();
 	}
 	
-	// get the ticket associated with this message id
-	if(waiting_recipients.count(message_id_rcvd)){
-		std::promise<Query>* ticket = &waiting_recipients.at(message_id_rcvd);
-		ticket->set_value(qry);
-		// remove it from the map of waiting promises
-		waiting_recipients.erase(message_id_rcvd);
-	} else {
-		// unknown message id?
-		Log("Unknown message id "+std::to_string(message_id_rcvd)+" with no client",v_error,verbosity);
-		return false;
+	if(read_cache && qry.success && qry.type=='r' && not pending.cache_key.empty()){
+		read_cache->Insert(pending.cache_key, qry.query_response, pending.cache_epoch);
 	}
 	
+	Log("PGClient got a response for query "+std::to_string(qry.msg_id),v_debug,verbosity);
+	Deliver(pending);
+	
 	return true;
 }
 
-bool PGClient::SendNextQuery(){
-	// send the next message in the waiting query queue
+bool PGClient::HandleChunk(uint32_t msg_id, std::vector<zmq::message_t>& response, int peer){
+	// pass a chunk of a streaming read to its consumer, and grant the middleman another chunk
+	PendingQuery* pending = waiting_recipients->Find(msg_id);
+	if(pending==nullptr){
+		// already timed out or cancelled; make sure the middleman stops sending
+		Log("Chunk for unknown or stale message id "+std::to_string(msg_id)+"; cancelling stream",v_debug,verbosity);
+		SendCredit(msg_id, 0, peer);
+		return false;
+	}
 	
-	if(waiting_senders.empty()){
-		// nothing to send
+	ResultSet chunk(std::move(response), 2);
+	if(ConsumeRows(*pending, chunk) && SendCredit(msg_id, 1, peer)){
+		// still alive; the timeout applies to the gap between chunks
+		pending->deadline = std::chrono::steady_clock::now() + pending->timeout;
 		return true;
 	}
 	
-	// get the next query to send
-	std::pair<Query, std::promise<int>>& next_qry = waiting_senders.front();
-	Query qry = next_qry.first;
-	std::cout<<"PGClient: sending query "<<qry.msg_id<<std::endl;
+	// consumer gave up (or we couldn't reach the middleman)
+	SendCredit(msg_id, 0, peer);
+	PendingQuery cancelled;
+	if(not waiting_recipients->Cancel(msg_id, cancelled)) return false;
+	cancelled.qry.success = false;
+	cancelled.qry.err = "Streaming query cancelled";
+	Deliver(cancelled);
+	return false;
+}
+
+bool PGClient::ConsumeRows(PendingQuery& pending, const ResultSet& rows){
+	// invoke a streaming query's row consumer. Returns false if it wants no more rows.
+	try {
+		return pending.on_rows(rows);
+	} catch(std::exception& e){
+		Log(std::string("Exception in row callback: ")+e.what(),v_error,verbosity);
+	} catch(...){
+		Log("Unknown exception in row callback",v_error,verbosity);
+	}
+	return false;
+}
+
+bool PGClient::SendCredit(uint32_t msg_id, uint32_t chunks, int peer){
+	// tell the middleman it may send this many more chunks of a streaming read (0 cancels it)
+	// it must go to the middleman sending the chunks (streaming reads are only allowed with peers)
+	frames_out.resize(2);
+	MakeFrame(reinterpret_cast<const char*>(&msg_id), sizeof(msg_id), frames_out.at(0));
+	MakeFrame(reinterpret_cast<const char*>(&chunks), sizeof(chunks), frames_out.at(1));
+	int ret = SendToPeer(peer);
+	frames_out.clear();
+	if(ret!=0) Log("Failed to send flow control for query "+std::to_string(msg_id),v_warning,verbosity);
+	return ret==0;
+}
+
+bool PGClient::SendNextQuery(){
+	// send the queries in the waiting query queue.
+	// drain everything that's ready (up to send_batch_size) so one wakeup handles a burst.
+	
+	// if a socket has no listener there's no point waiting on it again for the rest of the batch
+	int pub_timeout = outpoll_timeout;
+	int dlr_timeout = outpoll_timeout;
+	
+	PendingQuery next_qry;
+	for(int sent=0; sent<send_batch_size; ++sent){
+		
+		// get the next query to send
+		if(not waiting_senders->TryPop(next_qry)){
+			// nothing (more) to send
+			break;
+		}
+		next_qry.qry.times.dequeued = std::chrono::steady_clock::now();
+		// reads taken after this write mustn't share the result of one sent before it
+		if(next_qry.qry.type=='w') ++write_epochs[next_qry.qry.dbname];
+		
+		int& timeout = (next_qry.qry.type=='w') ? pub_timeout : dlr_timeout;
+		
+		// point lookups are held back to go out with others using the same template
+		if(next_qry.lookup_id!=0){
+			std::string key = std::to_string(next_qry.lookup_id);
+			if(lookup_batcher->Add(key, std::move(next_qry), std::chrono::steady_clock::now())){
+				std::vector<PendingQuery> batch;
+				lookup_batcher->Take(key, batch);
+				if(DispatchLookups(batch, dlr_timeout)==-2) dlr_timeout = 0;
+			}
+			continue;
+		}
+		
+		// plain INSERTs may be held back to go out with others to the same table
+		if(write_batcher && next_qry.qry.type=='w'){
+			std::string table = GetInsertTable(next_qry.qry.query_string);
+			if(not table.empty()){
+				std::string key = next_qry.qry.dbname+'\0'+table;
+				if(write_batcher->Add(key, std::move(next_qry), std::chrono::steady_clock::now())){
+					// batch is full, send it now
+					std::vector<PendingQuery> batch;
+					write_batcher->Take(key, batch);
+					if(DispatchBatch(batch, pub_timeout)==-2) pub_timeout = 0;
+				}
+				continue;
+			}
+		}
+		
+		// reads identical to one already in flight just wait for its result
+		if(JoinRead(next_qry)) continue;
+		
+		int ret = DispatchQuery(next_qry, timeout);
+		if(ret==-2) timeout = 0;
+	}
+	
+	// send any batches that have waited long enough
+	if(write_batcher && not write_batcher->Empty()){
+		std::vector<std::vector<PendingQuery>> due;
+		write_batcher->TakeDue(std::chrono::steady_clock::now(), due);
+		for(std::vector<PendingQuery>& batch : due){
+			if(DispatchBatch(batch, pub_timeout)==-2) pub_timeout = 0;
+		}
+	}
+	if(not lookup_batcher->Empty()){
+		std::vector<std::vector<PendingQuery>> due;
+		lookup_batcher->TakeDue(std::chrono::steady_clock::now(), due);
+		for(std::vector<PendingQuery>& batch : due){
+			if(DispatchLookups(batch, dlr_timeout)==-2) dlr_timeout = 0;
+		}
+	}
+	
+	return true;
+}
+
+size_t PGClient::ReadHash(const Query& qry){
+	// identifies reads that would return the same result; 0 for queries that can't be shared,
+	// including those whose result differs each time they're run (see ReadCache::IsVolatile)
+	if(qry.type!='r') return 0;
+	size_t hash;
+	if(qry.statement_id==0){
+		if(qry.query_string.empty()) return 0;  // large query already handed to zmq
+		if(ReadCache::IsVolatile(qry.query_string)) return 0;
+		hash = std::hash<std::string>()(qry.dbname) ^ (std::hash<std::string>()(qry.query_string) * 31);
+	} else {
+		{
+			std::lock_guard<std::mutex> lock(statements_mtx);
+			if(qry.statement_id>statements.size() || not statements.at(qry.statement_id-1).shareable) return 0;
+		}
+		hash = std::hash<std::string>()(qry.dbname) ^ (std::hash<std::string>()(qry.params) * 31) ^ qry.statement_id;
+	}
+	return (hash==0) ? 1 : hash;
+}
+
+bool PGClient::JoinRead(PendingQuery& next_qry){
+	// if an identical read is already awaiting its response, wait for that rather than
+	// sending another. Returns true if next_qry was taken.
+	if(not single_flight_reads || next_qry.on_rows) return false;
+	size_t hash = ReadHash(next_qry.qry);
+	if(hash==0) return false;
+	std::unordered_map<size_t, uint32_t>::iterator it = reads_in_flight.find(hash);
+	if(it==reads_in_flight.end()) return false;
+	PendingQuery* leader = waiting_recipients->Find(it->second);
+	// only wait on reads that will be answered (or time out) before we would
+	if(leader==nullptr || leader->on_rows || leader->deadline>next_qry.deadline) return false;
+	// hashes can collide; check it really is the same query
+	const Query& led = leader->qry;
+	if(led.dbname!=next_qry.qry.dbname || led.statement_id!=next_qry.qry.statement_id ||
+	   led.query_string!=next_qry.qry.query_string || led.params!=next_qry.qry.params){
+		return false;
+	}
+	// nor on one sent before a write to its database that this read may need to see
+	if(leader->write_epoch!=write_epochs[next_qry.qry.dbname]) return false;
+	if(not leader->followers) leader->followers = std::make_shared<std::vector<PendingQuery>>();
+	leader->followers->push_back(std::move(next_qry));
+	++reads_coalesced;
+	return true;
+}
+
+int PGClient::DispatchBatch(std::vector<PendingQuery>& batch, int timeout){
+	// send a group of writes to the same table as one message, and register it to await its
+	// acknowledgement. Returns the PollAndSend status.
+	
+	// drop any the caller has already given up on
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::vector<PendingQuery> members;
+	members.reserve(batch.size());
+	for(PendingQuery& next_qry : batch){
+		if(now >= next_qry.deadline){
+			next_qry.qry.success = false;
+			next_qry.qry.err = "Timed out sending query";
+			Deliver(next_qry);
+		} else {
+			members.push_back(std::move(next_qry));
+		}
+	}
+	if(members.empty()) return 0;
+	if(members.size()==1) return DispatchQuery(members.front(), timeout);
+	
+	// the batch stands in for its members until acknowledged; it times out with the first of them
+	PendingQuery next_batch;
+	next_batch.qry = Query{members.front().qry.dbname, "", 'w'};
+	next_batch.cache_key = members.front().cache_key;   // they all write the same table
+	next_batch.deadline = members.front().deadline;
+	for(PendingQuery& member : members) next_batch.deadline = std::min(next_batch.deadline, member.deadline);
+	next_batch.batch = std::make_shared<std::vector<PendingQuery>>(std::move(members));
+	
+	uint32_t thismsgid;
+	if(not waiting_recipients->Register(std::move(next_batch), thismsgid)){
+		Log("Too many queries awaiting a response, dropping batch",v_warning,verbosity);
+		next_batch.qry.success = false;
+		next_batch.qry.err = "Too many queries in flight";
+		Deliver(next_batch);
+		return 0;
+	}
+	PendingQuery* pending = waiting_recipients->Find(thismsgid);
+	pending->qry.msg_id = thismsgid;
+	Log("PGClient: sending batch of "+std::to_string(pending->batch->size())+" writes as "+std::to_string(thismsgid),v_debug,verbosity);
+	
+	BuildFrames(*pending, 0);
+	int ret = SendFrames(*pending, timeout);
+	
+	return AwaitResponse(thismsgid, ret);
+}
+
+int PGClient::DispatchLookups(std::vector<PendingQuery>& batch, int timeout){
+	// send a group of lookups using the same template as one read of all their keys.
+	// Returns the PollAndSend status.
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::vector<PendingQuery> members;
+	members.reserve(batch.size());
+	for(PendingQuery& next_qry : batch){
+		if(now >= next_qry.deadline){
+			next_qry.qry.success = false;
+			next_qry.qry.err = "Timed out sending query";
+			Deliver(next_qry);
+		} else {
+			members.push_back(std::move(next_qry));
+		}
+	}
+	if(members.empty()) return 0;
 	
-	// write queries go to the pub socket, read queries to the dealer
-	zmq::socket_t* thesocket = (qry.type=='w') ? clt_pub_socket : clt_dlr_socket;
+	LookupTemplate lookup;
+	{
+		std::lock_guard<std::mutex> lock(lookups_mtx);
+		lookup = lookups.at(members.front().lookup_id-1);
+	}
+	
+	// the keys as an array literal, which postgres casts to the key column's type:
+	// '{"k1","k2"}', with quotes and backslashes in keys escaped for the array,
+	// and then single quotes doubled for the SQL string
+	std::string keys = "'{";
+	std::set<std::string> seen;
+	for(PendingQuery& member : members){
+		if(not seen.insert(member.lookup_key).second) continue;
+		if(keys.size()>2) keys += ',';
+		keys += '"';
+		for(char c : member.lookup_key){
+			if(c=='"' || c=='\\') keys += '\\';
+			else if(c=='\'') keys += '\'';
+			keys += c;
+		}
+		keys += '"';
+	}
+	keys += "}'";
+	
+	// each row is returned as "<key length>:<key><value>", so it can be matched to its lookup
+	// whatever characters the key and value hold. A NULL value is returned as ''. Rows whose
+	// key is NULL can't match "= ANY", so never come back.
+	std::string key_text = "("+lookup.key_column+")::text";
+	PendingQuery next_batch;
+	next_batch.qry = Query{lookup.dbname, "SELECT octet_length("+key_text+") || ':' || "+key_text+" || coalesce(("+
+	                       lookup.expression+")::text, '') FROM "+lookup.tables+" WHERE "+
+	                       lookup.key_column+" = ANY("+keys+")", 'r'};
+	next_batch.lookup_id = members.front().lookup_id;
+	next_batch.deadline = members.front().deadline;
+	for(PendingQuery& member : members) next_batch.deadline = std::min(next_batch.deadline, member.deadline);
+	next_batch.batch = std::make_shared<std::vector<PendingQuery>>(std::move(members));
+	Log("PGClient: sending "+std::to_string(next_batch.batch->size())+" lookups of "+std::to_string(seen.size())+" keys",v_debug,verbosity);
+	
+	return DispatchQuery(next_batch, timeout);
+}
+
+int PGClient::DispatchQuery(PendingQuery& next_qry, int timeout){
+	// send one query, and register it to await its response. Returns the PollAndSend status.
+	
+	// don't bother sending if the caller has already given up on it
+	if(std::chrono::steady_clock::now() >= next_qry.deadline){
+		next_qry.qry.success = false;
+		next_qry.qry.err = "Timed out sending query";
+		Deliver(next_qry);
+		return 0;
+	}
+	
+	// register the query to await its response.
+	// This also allocates a unique id for this message.
+	uint32_t thismsgid;
+	if(not waiting_recipients->Register(std::move(next_qry), thismsgid)){
+		Log("Too many queries awaiting a response, dropping query",v_warning,verbosity);
+		next_qry.qry.success = false;
+		next_qry.qry.err = "Too many queries in flight";
+		Deliver(next_qry);
+		return 0;
+	}
+	PendingQuery* pending = waiting_recipients->Find(thismsgid);
+	Query& qry = pending->qry;
+	qry.msg_id = thismsgid;
+	Log("PGClient: sending query "+std::to_string(qry.msg_id),v_debug,verbosity);
+	
+	BuildFrames(*pending, 0);
 	
 	// send out the query
-	// queries should be formatted as 4 parts:
-	// 1. client ID     (automatically prepended by our dealer socket)
+	int ret = SendFrames(*pending, timeout);
+	
+	// let identical reads join this one while it's in flight
+	if(ret==0 && single_flight_reads && qry.type=='r' && not pending->on_rows && not pending->batch){
+		pending->flight_hash = ReadHash(qry);
+		pending->write_epoch = write_epochs[qry.dbname];
+		if(pending->flight_hash!=0) reads_in_flight[pending->flight_hash] = thismsgid;
+	}
+	
+	return AwaitResponse(thismsgid, ret);
+	
+}
+
+int PGClient::AwaitResponse(uint32_t thismsgid, int ret){
+	// after sending a registered query: fail it if sending failed, otherwise start its timeout
+	
+	// check for errors sending
+	if(ret!=0){
+		std::string errmsg;
+		if(ret==-3) errmsg="Error polling out socket in PollAndSend! Is socket closed?";
+		if(ret==-2) errmsg="No listener on out socket in PollAndSend!";
+		if(ret==-2 && peers && peers->Connected()==0) errmsg="No middleman known on read socket (with read_routing "+read_routing+
+		                                                     ", middlemen must announce themselves with ZMQ_PROBE_ROUTER)";
+		if(ret==-1) errmsg="Error sending in PollAndSend!";
+		Log(errmsg,v_debug,verbosity);
+		PendingQuery failed;
+		waiting_recipients->Cancel(thismsgid, failed);
+		failed.qry.success = false;
+		failed.qry.err = errmsg;
+		Deliver(failed);
+		return ret;
+	}
+	
+	// sent; now wait for the response, but don't hang forever.
+	PendingQuery* pending = waiting_recipients->Find(thismsgid);
+	pending->qry.times.sent = std::chrono::steady_clock::now();
+	pending->resend_at = pending->qry.times.sent + std::chrono::milliseconds(resend_period.total_milliseconds());
+	if(hedge_reads && pending->qry.type=='r' && not pending->on_rows && hedge_delay.count()>0){
+		pending->hedge_at = pending->qry.times.sent + hedge_delay;
+	}
+	deadlines.emplace(NextCheck(*pending), thismsgid);
+	
+	return ret;
+}
+
+void PGClient::BuildFrames(PendingQuery& pending, uint32_t flags){
+	// build the frames of a registered query in frames_out, for sending or resending
+	Query& qry = pending.qry;
+	std::vector<zmq::message_t>& frames = frames_out;
+	
+	if(pending.batch && pending.lookup_id==0){
+		// batched writes are formatted as a normal write with one part per SQL statement:
+		// ([topic])[client ID][message ID][database name][SQL statement][SQL statement]...
+		if(write_topics){
+			frames.emplace_back();
+			MakeTopicFrame(pending, frames.back());
+		}
+		size_t first = frames.size();
+		frames.resize(first+3+pending.batch->size());
+		MakeFrame(clt_ID.c_str(), clt_ID.size(), frames.at(first));
+		MakeFrame(reinterpret_cast<const char*>(&qry.msg_id), sizeof(qry.msg_id), frames.at(first+1));
+		MakeDbnameFrame(qry.dbname, flags, frames.at(first+2));
+		for(size_t i=0; i<pending.batch->size(); ++i){
+			MakeStatementFrame(pending.batch->at(i).qry.query_string, true, frames.at(first+3+i));
+		}
+		return;
+	}
+	
+	// build the frames. queries should be formatted as 4 parts:
+	// 1. client ID     (automatically prepended by our dealer socket; added by us for writes,
+	//                   since the middleman's sub socket doesn't, and it needs it to acknowledge them)
 	// 2. message ID
 	// 3. database name
-	// 4. SQL statement
-	int ret = PollAndSend(thesocket, out_polls.at(1), outpoll_timeout, qry.msg_id, qry.dbname, qry.query_string);
-	std::cout<<"PGClient SNQ P&S returned "<<ret<<std::endl;
+	// 4. SQL statement, or for prepared statements the ExecuteHeader and parameters
+	//    (and the SQL, if the middleman has asked for it)
+	// 5. (streaming reads only) the chunk size and window
+	// Writes may also be preceded by a topic, for middlemen to subscribe to (see write_topics).
+	// Large query strings (e.g. big INSERTs) are handed to zmq without copying,
+	// in which case qry.query_string is left empty, or compressed if that's enabled.
+	if(qry.type=='w'){
+		if(write_topics){
+			frames.emplace_back();
+			MakeTopicFrame(pending, frames.back());
+		}
+		frames.emplace_back();
+		MakeFrame(clt_ID.c_str(), clt_ID.size(), frames.back());
+	}
+	frames.emplace_back();
+	MakeFrame(reinterpret_cast<const char*>(&qry.msg_id), sizeof(qry.msg_id), frames.back());
+	frames.emplace_back();
+	MakeDbnameFrame(qry.dbname, flags, frames.back());
+	if(qry.statement_id==0){
+		frames.emplace_back();
+		if(pending.sent_statement){
+			frames.back().copy(pending.sent_statement.get());
+		} else {
+			MakeStatementFrame(qry.query_string, false, frames.back());
+			// if it was handed over without copying, keep a reference to the frame for resends and hedges
+			if(qry.query_string.empty() && (Retries(pending)>0 || (hedge_reads && qry.type=='r' && not pending.on_rows))){
+				pending.sent_statement = std::make_shared<zmq::message_t>();
+				pending.sent_statement->copy(&frames.back());
+			}
+		}
+	} else {
+		ExecuteHeader header;
+		memcpy(header.marker, EXECUTE_MARKER, sizeof(header.marker));
+		header.statement_id = qry.statement_id;
+		header.n_params = qry.n_params;
+		frames.emplace_back();
+		MakeFrame(reinterpret_cast<const char*>(&header), sizeof(header), frames.back());
+		frames.emplace_back();
+		MakeFrame(qry.params.data(), qry.params.size(), frames.back());
+		if(pending.send_statement){
+			std::string sql = GetStatementSQL(qry.statement_id);
+			frames.emplace_back();
+			MakeStatementFrame(sql, false, frames.back());
+		}
+	}
+	if(pending.on_rows){
+		StreamRequest stream{(uint32_t)stream_chunk_rows, (uint32_t)stream_window};
+		frames.emplace_back();
+		MakeFrame(reinterpret_cast<const char*>(&stream), sizeof(stream), frames.back());
+	}
+}
+
+int PGClient::SendFrames(PendingQuery& pending, int timeout){
+	// send the frames built in frames_out: writes to the pub socket, reads to the dealer
+	if(pending.qry.type=='w' && not write_master.empty()){
+		// or just to the master, if we know it. If it can't be reached, publish as usual;
+		// the master is subscribed too.
+		if(PollAndSend(clt_wrt_socket, out_polls.at(2), 0, frames_out)==0){
+			frames_out.clear();
+			return 0;
+		}
+		Log("Master middleman not reachable, publishing write "+std::to_string(pending.qry.msg_id),v_debug,verbosity);
+	}
+	if(peers && pending.qry.type!='w'){
+		// or to the middleman of our choosing, preferring another if it's been sent before.
+		// An earlier copy is given up on, but a hedged copy remains outstanding with its
+		// middleman until the query is answered or times out.
+		int previous = pending.peer;
+		if(pending.peer>=0) peers->Done(pending.peer);
+		pending.peer = -1;
+		int ret = SendRouted(pending.peer, previous);
+		frames_out.clear();
+		return ret;
+	}
+	zmq::socket_t* thesocket = (pending.qry.type=='w') ? clt_pub_socket : clt_dlr_socket;
+	zmq::pollitem_t& thepoll = (pending.qry.type=='w') ? out_polls.at(0) : out_polls.at(1);
+	int ret = PollAndSend(thesocket, thepoll, timeout, frames_out);
+	frames_out.clear();
+	return ret;
+}
+
+std::chrono::steady_clock::time_point PGClient::NextCheck(const PendingQuery& pending){
+	// when CheckTimeouts next needs to look at a query: its deadline, or its next resend or hedge if sooner
+	std::chrono::steady_clock::time_point next = pending.deadline;
+	if(pending.retries<Retries(pending)) next = std::min(next, pending.resend_at);
+	if(pending.hedge_at!=std::chrono::steady_clock::time_point()) next = std::min(next, pending.hedge_at);
+	return next;
+}
+
+int PGClient::Retries(const PendingQuery& pending){
+	// how many times a query may be resent. Streaming reads never are. Nor are writes unless
+	// resend_writes is set: middlemen that don't recognise REQ_RESEND would apply a write again
+	// if only its acknowledgement was lost, so resending changes writes from being applied
+	// at most once to at least once.
+	if(pending.on_rows) return 0;
+	if(pending.qry.type=='w' && not resend_writes) return 0;
+	return max_retries;
+}
+
+void PGClient::Hedge(uint32_t msg_id, PendingQuery& pending){
+	// a read is taking longer than most; send a copy, and take whichever response arrives first.
+	// Only one copy is sent. With read_routing the copy goes to a different middleman, and isn't
+	// sent if there's no other; otherwise the dealer socket passes it to whichever is next in
+	// turn, which may be the one already handling it.
+	pending.hedge_at = std::chrono::steady_clock::time_point();
+	if(peers && peers->Connected()<2) return;
+	Log("Hedging read "+std::to_string(msg_id),v_debug,verbosity);
+	BuildFrames(pending, 0);
+	int ret;
+	if(peers){
+		ret = SendRouted(pending.hedge_peer, pending.peer);
+		frames_out.clear();
+	} else {
+		ret = SendFrames(pending, 0);
+	}
+	if(ret!=0){
+		Log("Failed to hedge read "+std::to_string(msg_id),v_debug,verbosity);
+		return;
+	}
+	++reads_hedged;
+}
+
+void PGClient::RecordReadLatency(std::chrono::steady_clock::duration latency){
+	// keep the most recent read latencies, and from them when to hedge a read
+	read_latencies.at(read_latencies_next % read_latencies.size()) = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+	++read_latencies_next;
+	if(read_latencies_next < read_latencies.size() || read_latencies_next % 256 != 0) return;
+	std::vector<long> sorted(read_latencies);
+	size_t nth = std::min(sorted.size()-1, sorted.size()*hedge_percentile/100);
+	std::nth_element(sorted.begin(), sorted.begin()+nth, sorted.end());
+	hedge_delay = std::max(std::chrono::microseconds(sorted.at(nth)), std::chrono::microseconds(hedge_min_delay_ms*1000));
+}
+
+void PGClient::Resend(uint32_t msg_id, PendingQuery& pending){
+	// no response yet, so send the query again with the same message id; the middleman may have
+	// missed it, or its response may have been lost. Whichever response arrives first completes
+	// the query, and any later ones are dropped as stale. Resends are flagged, so the middleman
+	// can use the client and message ids to avoid applying a write twice.
+	++pending.retries;
+	pending.resend_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(resend_period.total_milliseconds());
+	// the middleman it went to has taken at least this long; the resend goes to another if we pick
+	if(pending.peer>=0) peers->RecordRTT(pending.peer, std::chrono::milliseconds(resend_period.total_milliseconds()));
+	Log("Resending query "+std::to_string(msg_id)+" (attempt "+std::to_string(pending.retries+1)+")",v_debug,verbosity);
+	BuildFrames(pending, REQ_RESEND);
+	if(SendFrames(pending, 0)!=0) Log("Failed to resend query "+std::to_string(msg_id),v_debug,verbosity);
+	++queries_resent;
+}
+
+int PGClient::SendRouted(int& peer, int avoid){
+	// send the frames built in frames_out on the router socket, to a middleman chosen by the
+	// read_routing policy (not 'avoid', unless it's the only one). Middlemen that have gone
+	// are forgotten and another tried. Returns the PollAndSend status; on success 'peer' is set.
+	for(size_t attempt=0; attempt<4; ++attempt){
+		peer = peers->Pick(avoid);
+		if(peer<0) return -2;   // no listener
+		int ret = SendToPeer(peer);
+		if(ret!=-2) return ret;
+		avoid = peer;
+	}
+	peer = -1;
+	return -2;
+}
+
+int PGClient::SendToPeer(int peer){
+	// send the frames built in frames_out on the router socket, to the given middleman.
+	// Returns -2 if it can't currently be sent to (gone, or not keeping up).
+	if(peer<0) return -2;
+	std::string identity = peers->Identity(peer);
+	zmq::message_t address;
+	MakeFrame(identity.data(), identity.size(), address);
+	bool sent = false;
+	try {
+		sent = clt_dlr_socket->send(address, ZMQ_SNDMORE | ZMQ_DONTWAIT);
+	} catch(zmq::error_t& e){
+		if(e.num()!=EHOSTUNREACH) return -1;
+		// disconnected; it'll announce itself again if it reconnects
+		Log("Middleman no longer connected on read socket",v_message,verbosity);
+		peers->Lost(peer);
+		return -2;
+	}
+	if(not sent) return -2;   // its queue is full
+	if(not Send(clt_dlr_socket, false, frames_out)) return -1;
+	peers->Sent(peer);
+	return 0;
+}
+
+void PGClient::ReleasePeers(PendingQuery& pending){
+	// the query is no longer outstanding with the middlemen it was sent to
+	if(pending.peer>=0) peers->Done(pending.peer);
+	if(pending.hedge_peer>=0) peers->Done(pending.hedge_peer);
+	pending.peer = -1;
+	pending.hedge_peer = -1;
+}
+
+std::vector<PeerSelector::PeerStats> PGClient::GetPeerStats(){
+	if(peers==nullptr) return std::vector<PeerSelector::PeerStats>{};
+	return peers->GetStats();
+}
+
+bool PGClient::FindMaster(){
+	// writes go only to the master middleman, which advertises its write port as master_service.
+	// UpdateConnections connects the write socket to any advertised we aren't already connected to.
+	// The most recent is taken as the master; if the master changes, we disconnect from the old one.
+	// It's remembered for master_expiry_ms, so its lingering adverts don't connect us to it again.
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if(now<next_master_check) return true;
+	next_master_check = now + std::chrono::milliseconds(master_check_period_ms);
+	
+	for(std::map<std::string, std::chrono::steady_clock::time_point>::iterator it=retired_masters.begin(); it!=retired_masters.end(); ){
+		if(it->second>now){
+			++it;
+			continue;
+		}
+		delete master_connections[it->first];
+		master_connections.erase(it->first);
+		it = retired_masters.erase(it);
+	}
 	
-	// notify the client that the message has been sent
-	std::promise<int>* ticket = &next_qry.second;
-	ticket->set_value(ret);
+	std::map<std::string, Store*> known = master_connections;
+	utilities->UpdateConnections(master_service, clt_wrt_socket, master_connections);
+	if(master_connections.size()==known.size()) return true;
 	
-	// pop the message off the queue; it has been sent.
-	waiting_senders.pop();
+	// (if more than one has appeared at once, we just go with one of them)
+	std::string master;
+	for(std::pair<const std::string, Store*>& connection : master_connections){
+		if(known.count(connection.first)==0) master = connection.first;
+	}
+	for(std::pair<const std::string, Store*>& connection : master_connections){
+		if(connection.first==master || retired_masters.count(connection.first)) continue;
+		clt_wrt_socket->disconnect("tcp://"+connection.first);
+		retired_masters[connection.first] = now + std::chrono::milliseconds(master_expiry_ms);
+	}
+	Log("Sending writes to master middleman at "+master+((write_master.empty()) ? "" : " (was "+write_master+")"),v_message,verbosity);
+	write_master = master;
 	
 	return true;
-	
 }
 
 bool PGClient::Finalise(){
 	// terminate our background thread
 	std::cout<<"sending background thread term signal"<<std::endl;
 	terminator.set_value();
+	Wake();
 	// wait for it to finish up and return
 	std::cout<<"waiting for background thread to rejoin"<<std::endl;
 	background_thread.join();
@@ -540,6 +2133,7 @@ bool PGClient::Finalise(){
 	std::cout<<"Removing services"<<std::endl;
 	utilities->RemoveService("psql_write");
 	utilities->RemoveService("psql_read");
+	if(metrics_advertised) utilities->RemoveService("psql_metrics");
 	
 	std::cout<<"Deleting ServiceDiscovery"<<std::endl;
 	delete service_discovery; service_discovery=nullptr;
@@ -550,6 +2144,24 @@ bool PGClient::Finalise(){
 	std::cout<<"deleting sockets"<<std::endl;
 	delete clt_pub_socket; clt_pub_socket=nullptr; 
 	delete clt_dlr_socket; clt_dlr_socket=nullptr;
+	delete clt_wrt_socket; clt_wrt_socket=nullptr;
+	delete clt_metrics_socket; clt_metrics_socket=nullptr;
+	for(std::pair<const std::string, Store*>& connection : master_connections) delete connection.second;
+	master_connections.clear();
+	
+	close(wake_fd); wake_fd=-1;
+	delete waiting_senders; waiting_senders=nullptr;
+	delete waiting_recipients; waiting_recipients=nullptr;
+	delete in_flight_window; in_flight_window=nullptr;
+	// zmq may still hold frames from the pool; it frees itself once they're released
+	frame_pool->Close(); frame_pool=nullptr;
+	delete write_batcher; write_batcher=nullptr;
+	delete lookup_batcher; lookup_batcher=nullptr;
+	delete read_cache; read_cache=nullptr;
+	delete peers; peers=nullptr;
+	delete flight_recorder; flight_recorder=nullptr;
+	for(std::pair<const std::string, LatencyStats*>& entry : latency_stats) delete entry.second;
+	latency_stats.clear();
 	
 	std::cout<<"deleting context"<<std::endl;
 	// only delete context if it's local, not from the parent DataModel.
@@ -560,6 +2172,8 @@ bool PGClient::Finalise(){
 	
 	// can't use 'Log' since we may have deleted the Logging class
 	std::cout<<"PGClient destructor done"<<std::endl;
+	
+	return true;
 }
 
 // =====================================================================
@@ -601,9 +2215,10 @@ bool PGClient::Send(zmq::socket_t* sock, bool more, zmq::message_t& message){
 }
 
 bool PGClient::Send(zmq::socket_t* sock, bool more, std::string messagedata){
-	// form the zmq::message_t
-	zmq::message_t message(messagedata.size()+1);
-	snprintf((char*)message.data(), messagedata.size()+1, "%s", messagedata.c_str());
+	// form the zmq::message_t. If we were given ownership of a large string
+	// its buffer goes straight to zmq, otherwise it's copied into a small frame.
+	zmq::message_t message;
+	MakeFrame(std::move(messagedata), message);
 	
 	// send it with given SNDMORE flag
 	bool send_ok;
@@ -613,15 +2228,27 @@ bool PGClient::Send(zmq::socket_t* sock, bool more, std::string messagedata){
 	return send_ok;
 }
 
+bool PGClient::Send(zmq::socket_t* sock, bool more, std::vector<zmq::message_t>& messages){
+	// send each of a set of prepared frames
+	for(size_t i=0; i<messages.size(); ++i){
+		bool last = (i==messages.size()-1);
+		bool send_ok = sock->send(messages.at(i), (last && not more) ? 0 : ZMQ_SNDMORE);
+		if(not send_ok) return false;
+	}
+	return true;
+}
+
 bool PGClient::Send(zmq::socket_t* sock, bool more, std::vector<std::string> messages){
 	
+	if(messages.empty()) return true;
+	
 	// loop over all but the last part in the input vector,
 	// and send with the SNDMORE flag
 	for(int i=0; i<(messages.size()-1); ++i){
 		
 		// form zmq::message_t
-		zmq::message_t message(messages.at(i).size()+1);
-		snprintf((char*)message.data(), messages.at(i).size()+1, "%s", messages.at(i).c_str());
+		zmq::message_t message;
+		MakeFrame(std::move(messages.at(i)), message);
 		
 		// send this part
 		bool send_ok = sock->send(message, ZMQ_SNDMORE);
@@ -631,8 +2258,8 @@ bool PGClient::Send(zmq::socket_t* sock, bool more, std::vector<std::string> mes
 	}
 	
 	// form the zmq::message_t for the last part
-	zmq::message_t message(messages.back().size()+1);
-	snprintf((char*)message.data(), messages.back().size()+1, "%s", messages.back().c_str());
+	zmq::message_t message;
+	MakeFrame(std::move(messages.back()), message);
 	
 	// send it with, or without SNDMORE flag as requested
 	bool send_ok;
@@ -642,6 +2269,72 @@ bool PGClient::Send(zmq::socket_t* sock, bool more, std::vector<std::string> mes
 	return send_ok;
 }
 
+void PGClient::MakeFrame(const char* data, size_t size, zmq::message_t& frame){
+	// copy data into a frame. zmq stores very small messages inside the zmq_msg_t itself,
+	// so those need no buffer at all; otherwise use a pooled buffer if it fits.
+	if(size<=max_vsm_size || not frame_pool->MakeFrame(data, size, frame)){
+		frame.rebuild(size);
+		memcpy(frame.data(), data, size);
+	}
+}
+
+void PGClient::MakeFrame(std::string&& data, zmq::message_t& frame){
+	// strings below the threshold are cheaper to copy than to hand over
+	if(data.size()<zero_copy_threshold){
+		MakeFrame(data.c_str(), data.size()+1, frame);
+		return;
+	}
+	// take ownership of the string (no copy of its contents) and give zmq its buffer directly.
+	// zmq frees it via FreeString once sent. Include the terminating null, as the middleman expects.
+	std::string* holder = new std::string(std::move(data));
+	frame.rebuild(&(*holder)[0], holder->size()+1, &PGClient::FreeString, holder);
+}
+
+void PGClient::MakeDbnameFrame(const std::string& dbname, uint32_t flags, zmq::message_t& frame){
+	// the database name, followed by request flags if there are any to send
+	if(compress_threshold>0) flags |= REQ_ACCEPT_COMPRESSED;
+	if(flags==0){
+		MakeFrame(dbname.c_str(), dbname.size()+1, frame);
+		return;
+	}
+	frame.rebuild(dbname.size()+1+sizeof(flags));
+	memcpy(frame.data(), dbname.c_str(), dbname.size()+1);
+	memcpy(static_cast<char*>(frame.data())+dbname.size()+1, &flags, sizeof(flags));
+}
+
+void PGClient::MakeTopicFrame(const PendingQuery& pending, zmq::message_t& frame){
+	// "<database>\0", or with write_topics 2 "<database>\0<table>\0", so subscribing to
+	// "<database>\0" gets all writes to a database, and "<database>\0<table>\0" those to one table
+	// (the table name is lower case, without quotes or schema, see ReadCache::WriteTable)
+	std::string topic = pending.qry.dbname;
+	topic += '\0';
+	if(write_topics==2){
+		topic += pending.cache_key;
+		topic += '\0';
+	}
+	MakeFrame(topic.data(), topic.size(), frame);
+}
+
+void PGClient::MakeStatementFrame(std::string& sql, bool keep, zmq::message_t& frame){
+	// a SQL statement, with its terminating null. Large statements are compressed, if enabled
+	// and the middlemen support it, or else handed to zmq without copying unless the caller
+	// wants to keep the string.
+	if(compress_threshold>0 && middleman_decompresses && sql.size()+1>=compress_threshold){
+		std::string compressed;
+		if(FrameCompression::Compress(sql.c_str(), sql.size()+1, compressed, compress_level)){
+			MakeFrame(compressed.data(), compressed.size(), frame);
+			return;
+		}
+	}
+	if(not keep && sql.size()>=zero_copy_threshold) MakeFrame(std::move(sql), frame);
+	else MakeFrame(sql.c_str(), sql.size()+1, frame);
+}
+
+void PGClient::FreeString(void* /*data*/, void* hint){
+	// called by zmq when it has finished with a zero-copy frame
+	delete static_cast<std::string*>(hint);
+}
+
 int PGClient::PollAndReceive(zmq::socket_t* sock, zmq::pollitem_t poll, int timeout, std::vector<zmq::message_t>& outputs){
 	
 	// poll the input socket for messages
@@ -656,6 +2349,7 @@ int PGClient::PollAndReceive(zmq::socket_t* sock, zmq::pollitem_t poll, int time
 		
 		// recieve all parts
 		get_ok = Receive(sock, outputs);
+		if(outputs.size()==0) return -2;
 		if(not get_ok) return -1;
 		
 	} else {
@@ -666,14 +2360,15 @@ int PGClient::PollAndReceive(zmq::socket_t* sock, zmq::pollitem_t poll, int time
 	return 0;
 }
 
-bool PGClient::Receive(zmq::socket_t* sock, std::vector<zmq::message_t>& outputs){
+bool PGClient::Receive(zmq::socket_t* sock, std::vector<zmq::message_t>& outputs, int flags){
+	// flags apply to the first part only (e.g. ZMQ_DONTWAIT); once we have that,
+	// the remaining parts of a multipart message are guaranteed to be available.
 	
 	outputs.clear();
-	int part=0;
 	
 	// recieve parts into tmp variable
 	zmq::message_t tmp;
-	while(sock->recv(&tmp)){
+	while(sock->recv(&tmp, (outputs.empty()) ? flags : 0)){
 		
 		// transfer the received message to the output vector
 		outputs.resize(outputs.size()+1);
@@ -684,6 +2379,9 @@ bool PGClient::Receive(zmq::socket_t* sock, std::vector<zmq::message_t>& outputs
 		
 	}
 	
+	// nothing received at all
+	if(outputs.empty()) return false;
+	
 	// if we broke the loop but last successfully received message had a more flag,
 	// we must have broken due to a failed receive
 	if(outputs.back().more()){
@@ -691,6 +2389,16 @@ bool PGClient::Receive(zmq::socket_t* sock, std::vector<zmq::message_t>& outputs
 		return false;
 	}
 	
+	// frames the middleman compressed are restored before anyone looks at them
+	if(compress_threshold>0){
+		for(zmq::message_t& frame : outputs){
+			if(FrameCompression::IsCompressed(frame) && not FrameCompression::Decompress(frame)){
+				Log("Received corrupt compressed frame",v_warning,verbosity);
+				return false;
+			}
+		}
+	}
+	
 	// otherwise no more parts. done.
 	return true;
 }
@@ -12,23 +12,94 @@
 #include <string>
 #include <iostream>
 #include <map>
+#include <unordered_map>
 #include <queue>
 #include <future>
+#include <functional>
+#include <chrono>
+#include <atomic>
+#include <mutex>
 #include <unistd.h>  // gethostname
+#include <sys/eventfd.h>
 
 #include "errnoname.h"
+#include "MPSCQueue.h"
+#include "CorrelationTable.h"
+#include "InFlightWindow.h"
+#include "FramePool.h"
+#include "ResultSet.h"
+#include "Protocol.h"
+#include "QueryBatcher.h"
+#include "QueryParams.h"
+#include "ReadCache.h"
+#include "FrameCompression.h"
+#include "PeerSelector.h"
+#include "LatencyHistogram.h"
+#include "FlightRecorder.h"
+
+// when a query reached each stage on its way through the client; unset if it didn't
+struct QueryTimes {
+	std::chrono::steady_clock::time_point submitted;
+	std::chrono::steady_clock::time_point dequeued;   // taken from the queue by the background thread
+	std::chrono::steady_clock::time_point sent;       // first sent (or, if it joined an identical read, when it joined)
+	std::chrono::steady_clock::time_point received;   // its response
+	std::chrono::steady_clock::time_point delivered;  // completed, just before any callback
+};
 
 struct Query {
 	Query(std::string dbname_in, std::string query_string_in, char query_type_in);
 	Query(const Query& qry_in);
+	Query(Query&& qry_in) = default;
+	Query& operator=(const Query& qry_in) = default;
+	Query& operator=(Query&& qry_in) = default;
 	Query(){};
 	std::string dbname;
-	std::string query_string;
+	std::string query_string;  // left empty once sent if it was large enough to be sent without copying
 	char type;
 	bool success;
-	std::vector<std::string> query_response;
+	ResultSet query_response;
 	std::string err;
-	int msg_id;
+	uint32_t msg_id = 0;
+	// for executions of prepared statements, instead of query_string
+	uint32_t statement_id = 0;
+	uint32_t n_params = 0;
+	std::string params;     // encoded by QueryParams
+	QueryTimes times;
+};
+
+// completion callback for asynchronous queries; invoked from the PGClient background thread,
+// except for read cache hits (see SetReadCacheTTL), which SubmitQuery completes on the caller's thread
+typedef std::function<void(Query&)> QueryCallback;
+// consumer for the rows of a streaming query, called with each chunk as it arrives on the
+// background thread. Views into the chunk are only valid during the call unless the ResultSet is kept.
+// Return false to cancel the query.
+typedef std::function<bool(const ResultSet&)> RowCallback;
+
+// a query in the hands of the background thread, along with who to notify on completion
+struct PendingQuery {
+	Query qry;
+	QueryCallback callback;
+	RowCallback on_rows;                              // set for streaming queries
+	std::shared_ptr<std::vector<PendingQuery>> batch; // for a batch of writes or lookups sent as one message, its queries
+	uint32_t lookup_id = 0;                           // point lookups: the template, and the key to look up
+	std::string lookup_key;
+	std::chrono::milliseconds timeout;
+	bool fail_fast = false;                           // don't wait for room in the in-flight window
+	bool send_statement = false;                      // include a prepared statement's SQL
+	std::string cache_key;                            // reads: where to cache the result. writes: the table written (if needed)
+	uint64_t cache_epoch = 0;
+	size_t flight_hash = 0;                           // reads: how identical reads find this one
+	uint64_t write_epoch = 0;                         // reads: write_epochs of its database when it was sent
+	std::shared_ptr<std::vector<PendingQuery>> followers;  // identical reads waiting on this one
+	bool timed_out = false;
+	std::shared_ptr<zmq::message_t> sent_statement;   // a large statement handed to zmq, kept for resending
+	int retries = 0;
+	std::chrono::steady_clock::time_point resend_at;  // send again if there's no response by this time
+	std::chrono::steady_clock::time_point hedge_at;   // reads: send a copy at this time, if set
+	size_t bytes = 0;                                 // SQL and parameters, while in flight
+	int peer = -1;                                    // reads, with read_routing: the middleman it was sent to,
+	int hedge_peer = -1;                              // and the one its hedged copy went to
+	std::chrono::steady_clock::time_point deadline;  // fail the query if not complete by this time
 };
 
 class DataModel;
@@ -46,15 +117,78 @@ class PGClient {
 	bool InitLogging();
 	bool RegisterServices();
 	bool FindNewClients();
+	bool FindMaster();
 	
 	// interfaces called by clients. These return within timeout
 	bool SendQuery(std::string dbname, std::string query_string, std::vector<std::string>* results, int* timeout_ms, std::string* err);
 	bool SendQuery(std::string dbname, std::string query_string, std::string* results, int* timeout_ms, std::string* err);
-	// wrapper funtion; add query to outgoing queue, receive response. ~30s timeout.
-	Query DoQuery(Query qry);
-	// actual send/receive functions
+	// as above, but the rows stay in the received frames and are only decoded on access
+	bool SendQuery(std::string dbname, std::string query_string, ResultSet* results, int* timeout_ms, std::string* err);
+	// non-blocking interfaces. These add the query to the outgoing queue and return immediately.
+	// The background thread completes the query with the response, or fails it after the timeout.
+	std::future<Query> SubmitQuery(std::string dbname, std::string query_string, int* timeout_ms=nullptr);
+	// callback is invoked on the background thread, so should be quick. Returns false if not queued.
+	// With read_cache_bytes set, a cache hit instead invokes it before returning, on this thread,
+	// so don't call this holding a lock the callback takes.
+	bool SubmitQuery(std::string dbname, std::string query_string, QueryCallback callback, int* timeout_ms=nullptr, std::string* err=nullptr);
+	// streaming reads. Rows are passed to on_rows in chunks as they arrive, with at most
+	// stream_window chunks of stream_chunk_rows rows requested from the middleman at a time,
+	// so memory use doesn't grow with the size of the result. on_done is then called with the
+	// outcome (and no rows). The timeout applies to the wait for each chunk.
+	// Needs read_routing p2c or least_outstanding, so flow control goes back to the middleman
+	// streaming the rows; with round_robin this returns false.
+	bool SubmitStreamingQuery(std::string dbname, std::string query_string, RowCallback on_rows, QueryCallback on_done, int* timeout_ms=nullptr, std::string* err=nullptr);
+	// fire-and-forget writes. Returns as soon as the write is queued, never blocking; returns false
+	// if it couldn't be, or isn't a write. Acknowledgements are tallied in the background (see
+	// GetUnwaitedWriteStats), and failures passed to the write error callback, if set. With
+	// fire_and_forget_writes set in the config, SendQuery does this for all writes.
+	bool SubmitWrite(std::string dbname, std::string query_string, std::string* err=nullptr);
+	// prepared statements. Register the SQL once, with placeholders $1, $2..., and get a compact
+	// id (0 on error); executions then send just the id and the encoded parameters (see QueryParams).
+	uint32_t PrepareStatement(std::string dbname, std::string sql, std::string* err=nullptr);
+	bool SubmitPrepared(uint32_t statement_id, const QueryParams& params, QueryCallback callback, int* timeout_ms=nullptr, std::string* err=nullptr);
+	bool SendPrepared(uint32_t statement_id, const QueryParams& params, std::vector<std::string>* results, int* timeout_ms, std::string* err);
+	// batched point lookups. Register a read of the form
+	//   SELECT <expression> FROM <tables> WHERE <key column> = $1
+	// and get an id for it (0 on error). Lookups of different keys submitted within
+	// lookup_batch_delay_ms of each other are sent as one query using "<key column> = ANY(...)",
+	// and each caller is given just the rows for its key: the value of <expression> as text
+	// (use e.g. row_to_json(t) for whole rows), or "" where it's NULL. Keys must be given as
+	// PostgreSQL prints them; rows whose key is NULL are never matched.
+	uint32_t RegisterLookup(std::string dbname, std::string sql, std::string* err=nullptr);
+	bool SubmitLookup(uint32_t lookup_id, std::string key, QueryCallback callback, int* timeout_ms=nullptr, std::string* err=nullptr);
+	bool SendLookup(uint32_t lookup_id, std::string key, std::vector<std::string>* results, int* timeout_ms, std::string* err);
+	// read result cache, enabled by setting read_cache_bytes. Cache hits complete immediately,
+	// with callbacks invoked on the submitting thread. Entries expire after read_cache_ttl_ms,
+	// or the TTL set here for reads of the given table (0 to never cache them).
+	void SetReadCacheTTL(std::string dbname, std::string table, int ttl_ms);
+	ReadCache::Stats GetReadCacheStats();
+	// number of reads that were answered by an identical read already in flight
+	long CoalescedReads(){ return reads_coalesced.load(); }
+	// number of times queries were sent again for lack of a response
+	long ResentQueries(){ return queries_resent.load(); }
+	// number of slow reads that were also sent to another middleman (see hedge_reads)
+	long HedgedReads(){ return reads_hedged.load(); }
+	// counters and gauges in the Prometheus text format; also served on metrics_address:metrics_port, if set
+	std::string GetMetrics();
+	// the timings of the most recent queries (flight_recorder_size of them), oldest first.
+	// Also logged automatically when a query times out.
+	std::string DumpFlightRecorder();
+	// the middlemen reads are routed between, and how each is doing (empty unless read_routing is set)
+	std::vector<PeerSelector::PeerStats> GetPeerStats();
+	// called on the background thread with each fire-and-forget write that fails. Set before use.
+	void SetWriteErrorCallback(QueryCallback callback);
+	struct UnwaitedWriteStats {
+		long submitted;
+		long acknowledged;
+		long failed;
+		long rejected;     // not queued, as there was no room
+	};
+	UnwaitedWriteStats GetUnwaitedWriteStats();
+	// actual send/receive functions. Each call drains up to a batch of queries/responses.
 	bool SendNextQuery();
 	bool GetNextRespose();
+	bool CheckTimeouts();
 	
 	bool TestMe();
 	
@@ -74,32 +208,190 @@ class PGClient {
 	
 	zmq::socket_t* clt_pub_socket = nullptr;
 	zmq::socket_t* clt_dlr_socket = nullptr;
+	zmq::socket_t* clt_wrt_socket = nullptr;   // writes to the master alone, if leader_writes is set
+	zmq::socket_t* clt_metrics_socket = nullptr;   // answers requests for metrics, if metrics_port is set
+	int metrics_port;
+	std::string metrics_address;
+	bool metrics_advertised = false;               // registered with service discovery; not if only on loopback
+	bool ServeMetrics();
+	// the master middleman's address (ip:port) if known, and former masters we've disconnected from,
+	// with when they may be connected to again. Background thread only.
+	std::string write_master;
+	std::map<std::string,Store*> master_connections;
+	std::map<std::string, std::chrono::steady_clock::time_point> retired_masters;
+	std::chrono::steady_clock::time_point next_master_check;
 	
 	std::vector<zmq::pollitem_t> in_polls;
 	std::vector<zmq::pollitem_t> out_polls;
 	
-	std::queue<std::pair<Query, std::promise<int>>> waiting_senders;
-	std::map<int, std::promise<Query>> waiting_recipients;
+	// eventfd in the background thread's poll set, written by submitters to wake it immediately
+	int wake_fd = -1;
+	void Wake();
+	
+	// lock-free submission queue: any thread pushes, only the background thread pops
+	MPSCQueue<PendingQuery>* waiting_senders = nullptr;
+	// pre-allocated slots matching response msg_ids to the queries waiting on them
+	CorrelationTable<PendingQuery>* waiting_recipients = nullptr;
+	// limits on how many queries may be outstanding at once
+	InFlightWindow* in_flight_window = nullptr;
+	// when each sent query times out, soonest first. Only used by the background thread.
+	typedef std::pair<std::chrono::steady_clock::time_point, uint32_t> Deadline;
+	std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>> deadlines;
+	
+	char GetQueryType(const std::string& query_string);
+	void Deliver(PendingQuery& pending);
+	int DispatchQuery(PendingQuery& next_qry, int timeout);
+	int DispatchBatch(std::vector<PendingQuery>& batch, int timeout);
+	int DispatchLookups(std::vector<PendingQuery>& batch, int timeout);
+	void DeliverLookups(PendingQuery& pending);
+	int AwaitResponse(uint32_t thismsgid, int ret);
+	void BuildFrames(PendingQuery& pending, uint32_t flags);
+	int SendFrames(PendingQuery& pending, int timeout);
+	void Resend(uint32_t msg_id, PendingQuery& pending);
+	void Hedge(uint32_t msg_id, PendingQuery& pending);
+	void RecordReadLatency(std::chrono::steady_clock::duration latency);
+	std::chrono::steady_clock::time_point NextCheck(const PendingQuery& pending);
+	int Retries(const PendingQuery& pending);
+	std::string GetInsertTable(const std::string& query_string);
+	std::string GetStatementSQL(uint32_t statement_id);
+	// prepared statement registry; statement id n is statements[n-1]
+	struct PreparedStatement {
+		std::string dbname;
+		std::string sql;
+		char type;
+		bool shareable;   // reads: whether identical executions in flight may share a result
+	};
+	std::vector<PreparedStatement> statements;
+	std::map<std::string, uint32_t> statement_ids;   // by dbname+'\0'+sql
+	std::mutex statements_mtx;
+	// lookup templates; lookup id n is lookups[n-1]
+	struct LookupTemplate {
+		std::string dbname;
+		std::string expression;
+		std::string tables;
+		std::string key_column;
+	};
+	std::vector<LookupTemplate> lookups;
+	std::map<std::string, uint32_t> lookup_ids;      // by dbname+'\0'+sql
+	std::mutex lookups_mtx;
+	// gathers lookups using the same template into one query. Background thread only.
+	QueryBatcher<PendingQuery>* lookup_batcher = nullptr;
+	ReadCache* read_cache = nullptr;
+	// single-flight reads: msg_id of the read in flight for each ReadHash. Background thread only.
+	std::unordered_map<size_t, uint32_t> reads_in_flight;
+	// count of writes to each database taken for sending or completed, so reads only share
+	// the result of one sent since the last write; a read made after a write was acknowledged
+	// then still sees it. Background thread only.
+	std::unordered_map<std::string, uint64_t> write_epochs;
+	size_t ReadHash(const Query& qry);
+	bool JoinRead(PendingQuery& next_qry);
+	// groups writes to the same table into one message, if write_batching is enabled
+	QueryBatcher<PendingQuery>* write_batcher = nullptr;
+	bool HandleResponse(std::vector<zmq::message_t>& response, int ret, int peer=-1);
+	bool Submit(PendingQuery&& pending, std::string* err);
+	bool HandleChunk(uint32_t msg_id, std::vector<zmq::message_t>& response, int peer);
+	bool ConsumeRows(PendingQuery& pending, const ResultSet& rows);
+	bool SendCredit(uint32_t msg_id, uint32_t chunks, int peer);
+	// picks the middleman for each read, if read_routing is p2c or least_outstanding
+	PeerSelector* peers = nullptr;
+	int SendRouted(int& peer, int avoid);
+	int SendToPeer(int peer);
+	void ReleasePeers(PendingQuery& pending);
 	
 	bool BackgroundThread(std::future<void> terminator);
 	std::thread background_thread;   // a thread that will perform zmq socket operations in the background
 	std::promise<void> terminator;   // call set_value to signal the background_thread should terminate
 	
-	// TODO add retrying
+	// queries without a response are sent again every resend_period, up to max_retries times
+	// (writes only with resend_writes)
 	int max_retries;
-	int inpoll_timeout;
+	int resend_writes;
+	int submit_queue_size;
+	int correlation_slots;
+	int send_batch_size;
+	int receive_batch_size;
+	size_t zero_copy_threshold;
+	int stream_chunk_rows;
+	int stream_window;
+	int write_batching;
+	int write_batch_rows;
+	int write_batch_delay_ms;
+	int lookup_batch_keys;
+	int lookup_batch_delay_ms;
+	size_t compress_threshold;
+	int compress_level;
+	bool middleman_decompresses;  // whether a middleman has said it accepts compressed frames
+	int hedge_reads;
+	int hedge_percentile;
+	int hedge_min_delay_ms;
+	std::string read_routing;
+	int read_routing_probe_ms;
+	int leader_writes;
+	std::string master_service;
+	int master_check_period_ms;
+	int master_expiry_ms;
+	int write_topics;
+	// latencies of recent reads (us), and the resulting delay before hedging. Background thread only.
+	std::vector<long> read_latencies = std::vector<long>(1024);
+	size_t read_latencies_next = 0;
+	std::chrono::microseconds hedge_delay{0};
+	int max_in_flight;
+	int max_in_flight_reads;
+	int max_in_flight_writes;
+	int backpressure_timeout_ms;
 	int outpoll_timeout;
 	int query_timeout;
 	
-	// TODO add stats reporting
+	// latencies of each query type and database: waiting to be sent, waiting for the response, and
+	// overall. Recorded only by the background thread, and printed every print_stats_period.
+	struct LatencyStats {
+		char type;
+		std::string dbname;
+		LatencyHistogram queued;
+		LatencyHistogram awaiting;
+		LatencyHistogram total;
+		std::atomic<long> failed{0};
+		// as of the last printout
+		LatencyHistogram::Snapshot last_queued;
+		LatencyHistogram::Snapshot last_awaiting;
+		LatencyHistogram::Snapshot last_total;
+		long last_failed = 0;
+	};
+	std::unordered_map<std::string, LatencyStats*> latency_stats;   // by type+dbname
+	std::mutex latency_stats_mtx;   // held by the background thread when adding, and by other threads reading
+	void RecordLatency(const PendingQuery& pending);
+	FlightRecorder* flight_recorder = nullptr;   // recent queries' timings; written only by the background thread
+	void RecordFlight(const PendingQuery& pending);
+	std::chrono::milliseconds flight_dump_period;
+	std::chrono::steady_clock::time_point next_flight_dump;   // timeouts before this don't dump it again
+	void PrintStats(boost::posix_time::ptime now);
+	
 	boost::posix_time::time_duration resend_period;      // time between resends if not acknowledged
 	boost::posix_time::time_duration print_stats_period; // time between printing info about what we're doing
 	boost::posix_time::ptime last_write;                 // when we last sent a write query
 	boost::posix_time::ptime last_read;                  // when we last sent a read query
 	boost::posix_time::ptime last_printout;              // when we last printed out stats about what we're doing
 	
-	int read_queries_failed;
-	int write_queries_failed;
+	std::atomic<long> read_queries_failed{0};
+	std::atomic<long> write_queries_failed{0};
+	std::atomic<long> queries_resent{0};
+	std::atomic<long> reads_hedged{0};
+	std::atomic<long> queries_timed_out{0};
+	std::atomic<long> bytes_in_flight{0};
+	
+	// reconciliation of fire-and-forget writes
+	int fire_and_forget_writes;
+	long read_cache_bytes;
+	int read_cache_ttl_ms;
+	int single_flight_reads;
+	std::atomic<long> reads_coalesced{0};
+	QueryCallback write_error_callback;
+	struct {
+		std::atomic<long> submitted{0};
+		std::atomic<long> acknowledged{0};
+		std::atomic<long> failed{0};
+		std::atomic<long> rejected{0};
+	} unwaited_writes;
 	
 	// general
 	int verbosity;
@@ -117,24 +409,38 @@ class PGClient {
 	// since that's the one the middleman needs to know to send replies back
 	std::string clt_ID;
 	
-	int msg_id = 0;
-	
 	// =======================================================
 	
 	// zmq helper functions
 	// TODO move to separate class as these are shared by middleman
 	
 	int PollAndReceive(zmq::socket_t* sock, zmq::pollitem_t poll, int timeout, std::vector<zmq::message_t>& outputs);
-	bool Receive(zmq::socket_t* sock, std::vector<zmq::message_t>& outputs);
+	bool Receive(zmq::socket_t* sock, std::vector<zmq::message_t>& outputs, int flags=0);
+	
+	// frame construction. Only used on the background thread.
+	// copy data into a frame; very small frames are stored inline by zmq, others use a pooled buffer
+	void MakeFrame(const char* data, size_t size, zmq::message_t& frame);
+	// take ownership of a string; large ones are handed to zmq without copying (zmq_msg_init_data)
+	void MakeFrame(std::string&& data, zmq::message_t& frame);
+	static void FreeString(void* data, void* hint);
+	void MakeDbnameFrame(const std::string& dbname, uint32_t flags, zmq::message_t& frame);
+	void MakeStatementFrame(std::string& sql, bool keep, zmq::message_t& frame);
+	void MakeTopicFrame(const PendingQuery& pending, zmq::message_t& frame);
+	FramePool* frame_pool = nullptr;
+	std::vector<zmq::message_t> frames_out;  // parts of the query being sent, reused
+	static const size_t max_vsm_size = 29;  // largest message zmq stores without allocating
 	
 	// base cases; send single (final) message part
 	// 1. case where we're given a zmq::message_t -> just send it
 	bool Send(zmq::socket_t* sock, bool more, zmq::message_t& message);
-	// 2. case where we're given a std::string -> specialise accessing underlying data
+	// 2. case where we're given a std::string -> specialise accessing underlying data.
+	//    pass an rvalue to avoid copying large strings.
 	bool Send(zmq::socket_t* sock, bool more, std::string messagedata);
 	// 3. case where we're given a vector of strings
 	bool Send(zmq::socket_t* sock, bool more, std::vector<std::string> messages);
-	// 4. generic case for other primitive types -> relies on &messagedata and sizeof(T) being suitable.
+	// 4. case where we're given a vector of prepared frames -> send each (leaves them empty)
+	bool Send(zmq::socket_t* sock, bool more, std::vector<zmq::message_t>& messages);
+	// 5. generic case for other primitive types -> relies on &messagedata and sizeof(T) being suitable.
 	template <typename T>
 	bool Send(zmq::socket_t* sock, bool more, T&& messagedata){
 		zmq::message_t message(sizeof(T));
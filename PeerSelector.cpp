@@ -0,0 +1,126 @@
+#include "PeerSelector.h"
+#include <algorithm>
+
+// weight of each new round trip time in a peer's moving average
+static const double rtt_weight = 0.2;
+
+PeerSelector::PeerSelector(Policy policy_in, std::chrono::milliseconds probe_interval_in) :
+	policy(policy_in), probe_interval(probe_interval_in), rng(std::random_device()()){
+}
+
+int PeerSelector::Add(const std::string& identity){
+	std::lock_guard<std::mutex> lock(mtx);
+	std::unordered_map<std::string, int>::iterator it = by_identity.find(identity);
+	if(it!=by_identity.end()){
+		Peer& peer = peers.at(it->second);
+		if(not peer.connected){
+			peer.connected = true;
+			++connected;
+		}
+		return it->second;
+	}
+	Peer peer;
+	peer.identity = identity;
+	peer.last_sent = std::chrono::steady_clock::now();
+	// until it has responded, assume it's as quick as the quickest, so it's tried soon
+	bool first = true;
+	for(const Peer& other : peers){
+		if(other.measured && (first || other.rtt_us<peer.rtt_us)){
+			peer.rtt_us = other.rtt_us;
+			first = false;
+		}
+	}
+	peers.push_back(peer);
+	++connected;
+	by_identity.emplace(identity, peers.size()-1);
+	return peers.size()-1;
+}
+
+void PeerSelector::Lost(int peer){
+	std::lock_guard<std::mutex> lock(mtx);
+	if(not peers.at(peer).connected) return;
+	peers.at(peer).connected = false;
+	--connected;
+}
+
+double PeerSelector::Score(const Peer& peer){
+	// lower is better
+	return (peer.outstanding+1) * std::max(peer.rtt_us, 1.0);
+}
+
+int PeerSelector::Pick(int avoid){
+	std::lock_guard<std::mutex> lock(mtx);
+	if(connected==0) return -1;
+	if(connected==1 || (connected==2 && avoid>=0 && peers.at(avoid).connected)){
+		for(size_t i=0; i<peers.size(); ++i){
+			if(peers[i].connected && ((int)i!=avoid || connected==1)) return i;
+		}
+	}
+
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	candidates.clear();
+	for(size_t i=0; i<peers.size(); ++i){
+		if(not peers[i].connected || (int)i==avoid) continue;
+		if(now-peers[i].last_sent >= probe_interval) return i;
+		candidates.push_back(i);
+	}
+
+	if(policy==LEAST_OUTSTANDING){
+		int best = candidates.front();
+		for(int i : candidates){
+			const Peer& peer = peers[i];
+			if(peer.outstanding<peers[best].outstanding ||
+			   (peer.outstanding==peers[best].outstanding && peer.rtt_us<peers[best].rtt_us)) best = i;
+		}
+		return best;
+	}
+
+	// power of two choices
+	std::uniform_int_distribution<size_t> dist(0, candidates.size()-1);
+	int first = candidates.at(dist(rng));
+	int second = candidates.at(dist(rng));
+	while(second==first) second = candidates.at(dist(rng));
+	return (Score(peers[first])<=Score(peers[second])) ? first : second;
+}
+
+std::string PeerSelector::Identity(int peer){
+	std::lock_guard<std::mutex> lock(mtx);
+	return peers.at(peer).identity;
+}
+
+size_t PeerSelector::Connected(){
+	std::lock_guard<std::mutex> lock(mtx);
+	return connected;
+}
+
+void PeerSelector::Sent(int peer){
+	std::lock_guard<std::mutex> lock(mtx);
+	Peer& the_peer = peers.at(peer);
+	++the_peer.outstanding;
+	++the_peer.sent;
+	the_peer.last_sent = std::chrono::steady_clock::now();
+}
+
+void PeerSelector::Done(int peer){
+	std::lock_guard<std::mutex> lock(mtx);
+	Peer& the_peer = peers.at(peer);
+	if(the_peer.outstanding>0) --the_peer.outstanding;
+}
+
+void PeerSelector::RecordRTT(int peer, std::chrono::steady_clock::duration rtt){
+	double rtt_us = std::chrono::duration_cast<std::chrono::microseconds>(rtt).count();
+	std::lock_guard<std::mutex> lock(mtx);
+	Peer& the_peer = peers.at(peer);
+	if(the_peer.measured) the_peer.rtt_us += rtt_weight * (rtt_us - the_peer.rtt_us);
+	else the_peer.rtt_us = rtt_us;
+	the_peer.measured = true;
+}
+
+std::vector<PeerSelector::PeerStats> PeerSelector::GetStats(){
+	std::lock_guard<std::mutex> lock(mtx);
+	std::vector<PeerStats> stats;
+	for(const Peer& peer : peers){
+		stats.push_back(PeerStats{peer.identity, peer.connected, peer.outstanding, peer.sent, peer.rtt_us});
+	}
+	return stats;
+}
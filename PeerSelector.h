@@ -0,0 +1,75 @@
+#ifndef PEERSELECTOR_H
+#define PEERSELECTOR_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <chrono>
+#include <random>
+
+// Keeps track of the middlemen connected to the client's read socket, and picks which one
+// each read is sent to (used when read_routing is not round_robin). Each middleman's round trip
+// time is a moving average over its recent responses, and its load is the number of queries
+// sent to it that are still outstanding. Policies:
+//   P2C                take two middlemen at random and use the one with the lower
+//                      (outstanding+1) * round trip time, so load moves away from slow or busy ones
+//                      without every client piling onto whichever is quickest
+//   LEAST_OUTSTANDING  the one with the fewest outstanding queries, the quicker one breaking ties
+// A middleman that hasn't been sent anything for probe_interval is picked next regardless,
+// so one that has recovered from being slow gets the chance to show it.
+// Peers are referred to by index, which stays valid (if not connected) once they've gone.
+// Used by the background thread, and GetStats from any thread, so guarded by a mutex.
+class PeerSelector {
+	public:
+	enum Policy { P2C, LEAST_OUTSTANDING };
+	PeerSelector(Policy policy_in, std::chrono::milliseconds probe_interval_in);
+
+	struct PeerStats {
+		std::string identity;   // its zmq identity (binary, unless the middleman sets one)
+		bool connected;
+		long outstanding;
+		long sent;
+		double rtt_us;          // moving average round trip time
+	};
+
+	// the index of the peer with this identity, added if new, and marked as connected
+	int Add(const std::string& identity);
+	// the peer can no longer be reached
+	void Lost(int peer);
+	// the peer to send the next query to, or -1 if none are connected.
+	// 'avoid' is only picked if no other peer is connected.
+	int Pick(int avoid=-1);
+	std::string Identity(int peer);
+	size_t Connected();
+
+	void Sent(int peer);
+	void Done(int peer);   // a query sent to it is no longer outstanding
+	// the time a peer took to respond, or has taken so far without responding
+	void RecordRTT(int peer, std::chrono::steady_clock::duration rtt);
+
+	std::vector<PeerStats> GetStats();
+
+	private:
+	struct Peer {
+		std::string identity;
+		bool connected = true;
+		long outstanding = 0;
+		long sent = 0;
+		double rtt_us = 0;
+		bool measured = false;
+		std::chrono::steady_clock::time_point last_sent;
+	};
+	double Score(const Peer& peer);
+
+	Policy policy;
+	std::chrono::milliseconds probe_interval;
+	std::mutex mtx;
+	std::vector<Peer> peers;
+	std::unordered_map<std::string, int> by_identity;
+	std::vector<int> candidates;   // scratch space for Pick
+	size_t connected = 0;
+	std::minstd_rand rng;
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef PGPROTOCOL_H
+#define PGPROTOCOL_H
+
+#include <cstdint>
+
+// Extensions to the client <-> middleman message format.
+//
+// read query:  [client ID][message ID][database name][SQL statement]([StreamRequest])
+// response:    [client ID][message ID][status][rows...]
+// credit:      [client ID][message ID][uint32_t chunks]   (streaming reads only)
+// write query: ([topic])[client ID][message ID][database name][SQL statement]...   (on the pub socket)
+// prepared:    [client ID][message ID][database name][ExecuteHeader][parameters]([SQL statement])
+//
+// A read query carrying a StreamRequest asks for its result set to be returned in chunks
+// of up to chunk_rows rows, each a normal response with RESP_MORE set in the status,
+// followed by a final response without it. The middleman may only have 'window' chunks
+// unacknowledged at once; the client grants another chunk with a credit message
+// each time it has consumed one, or cancels the query with a credit of 0.
+//
+// Clients may use a router socket for reads instead of a dealer, to choose which middleman each
+// read goes to. They only learn of a middleman once it has sent them something, so middlemen
+// should set ZMQ_PROBE_ROUTER on their router socket, which announces them with an empty message
+// as they connect. Clients ignore these messages whatever their socket type.
+//
+// Clients configured with write_topics start each write with a topic frame, so middlemen can
+// subscribe to just the databases they serve and have the client's pub socket filter the rest:
+// "<database>\0", or with write_topics 2 "<database>\0<table>\0". Subscribe to "<database>\0"
+// for all writes to a database, or "<database>\0<table>\0" for one table. Writes whose table
+// can't be determined have the topic "<database>\0\0". Middlemen must drop the topic frame
+// when write_topics is set (and subscribe to "" otherwise).
+//
+// Clients may instead send writes only to the master, with leader_writes set. The master should
+// advertise a port through service discovery as "psql_master", with a PULL socket bound to it;
+// clients connect a PUSH socket to it and send writes in the same format as on the pub socket.
+// When the master changes, clients move to whichever was advertised most recently.
+// They still publish writes when they can't reach a master, so it should stay subscribed too.
+//
+// Writes are acknowledged with a normal response on the dealer socket, routed by the client ID
+// they carry. A write with more than one SQL statement is a batch of independent writes to the
+// same table; its acknowledgement has one row per statement, empty if it succeeded or otherwise
+// holding its error.
+//
+// A prepared statement execution (read or write) replaces the SQL statement with an
+// ExecuteHeader, identifying a statement the client registered, and its parameters
+// encoded as described in QueryParams.h. If the middleman hasn't yet prepared that
+// statement for this client it responds with RESP_UNKNOWN_STATEMENT set, and the client
+// sends the execution again with the statement's SQL appended, for the middleman to prepare
+// and remember under that id.
+//
+// The database name may be followed, after its terminating null, by a uint32_t of request flags.
+// REQ_ACCEPT_COMPRESSED tells the middleman it may compress frames of the response.
+// REQ_RESEND marks a query sent again because no response arrived in time. The client ID and
+// message ID identify the original, so the middleman should not apply a resent write it has
+// already applied, but acknowledge it again.
+// Any frame, in either direction, may be compressed: a CompressedHeader followed by the zlib
+// compressed contents. The header begins with a null byte, so it can't be mistaken for SQL or a row.
+// A middleman that can decompress frames sent to it says so by setting RESP_ACCEPTS_COMPRESSED
+// in its responses to requests with REQ_ACCEPT_COMPRESSED; the client only compresses what it
+// sends once it has seen that.
+
+// the low byte of the response status is the outcome (1 success, 0 failure); the rest are flags
+const int RESP_STATUS_MASK = 0xff;
+const int RESP_MORE = 1<<8;        // further chunks of this result set follow
+const int RESP_UNKNOWN_STATEMENT = 1<<9;  // resend the prepared statement execution with its SQL
+const int RESP_ACCEPTS_COMPRESSED = 1<<10; // the middleman can decompress frames sent to it
+
+struct StreamRequest {
+	uint32_t chunk_rows;
+	uint32_t window;
+};
+
+// begins with a null byte, so it can't be mistaken for SQL
+struct ExecuteHeader {
+	char marker[4];      // {'\0','P','X','1'}
+	uint32_t statement_id;
+	uint32_t n_params;
+};
+const char EXECUTE_MARKER[4] = {'\0','P','X','1'};
+
+// request flags, following the database name
+const uint32_t REQ_ACCEPT_COMPRESSED = 1<<0;
+const uint32_t REQ_RESEND = 1<<1;
+
+struct CompressedHeader {
+	char marker[4];      // {'\0','Z','L','1'}
+	uint32_t raw_size;   // size of the frame once decompressed
+};
+const char COMPRESSED_MARKER[4] = {'\0','Z','L','1'};
+
+#endif
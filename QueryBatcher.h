@@ -0,0 +1,79 @@
+#ifndef QUERYBATCHER_H
+#define QUERYBATCHER_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+
+// Groups queries that can be sent to the middleman together (e.g. writes to the same table,
+// or lookups using the same template), so they go as one message rather than one message each.
+// A batch is due once it holds max_rows queries, or once the oldest query in it has waited
+// max_delay, which bounds the latency added to any query.
+// Only used by the PGClient background thread, so not thread-safe.
+template <typename T>
+class QueryBatcher {
+	public:
+	typedef std::chrono::steady_clock::time_point time_point;
+
+	QueryBatcher(size_t max_rows_in, std::chrono::milliseconds max_delay_in) :
+		max_rows(max_rows_in), max_delay(max_delay_in){
+		if(max_rows<1) max_rows = 1;
+	}
+
+	// add a query to the batch for key. Returns true if that batch is now full.
+	bool Add(const std::string& key, T&& item, time_point now){
+		Batch& batch = batches[key];
+		if(batch.items.empty()) batch.due = now + max_delay;
+		batch.items.push_back(std::move(item));
+		++n_items;
+		return batch.items.size() >= max_rows;
+	}
+
+	// remove the batch for key
+	bool Take(const std::string& key, std::vector<T>& items){
+		typename std::unordered_map<std::string, Batch>::iterator it = batches.find(key);
+		if(it==batches.end()) return false;
+		n_items -= it->second.items.size();
+		items = std::move(it->second.items);
+		batches.erase(it);
+		return true;
+	}
+
+	// remove all batches that are due at 'now' (or all batches, if flush_all)
+	void TakeDue(time_point now, std::vector<std::vector<T>>& due, bool flush_all=false){
+		for(typename std::unordered_map<std::string, Batch>::iterator it=batches.begin(); it!=batches.end(); ){
+			if(flush_all || it->second.due<=now){
+				n_items -= it->second.items.size();
+				due.push_back(std::move(it->second.items));
+				it = batches.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	// when the next batch will be due. Only meaningful if not Empty().
+	time_point NextDue() const {
+		time_point next = time_point::max();
+		for(typename std::unordered_map<std::string, Batch>::const_iterator it=batches.begin(); it!=batches.end(); ++it){
+			if(it->second.due<next) next = it->second.due;
+		}
+		return next;
+	}
+
+	bool Empty() const { return n_items==0; }
+	size_t Size() const { return n_items; }
+
+	private:
+	struct Batch {
+		std::vector<T> items;
+		time_point due;
+	};
+	std::unordered_map<std::string, Batch> batches;
+	size_t n_items = 0;
+	size_t max_rows;
+	std::chrono::milliseconds max_delay;
+};
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef QUERYPARAMS_H
+#define QUERYPARAMS_H
+
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <endian.h>
+#include <cmath>
+#include <cstdio>
+#include <type_traits>
+
+// Parameters for executing a prepared statement, encoded as the middleman will pass
+// them to PQexecPrepared: for each parameter in order,
+//   [int16 format][int32 length][length bytes of value]
+// with the format and length in network byte order; a length of -1 is NULL (with no value bytes).
+// No parameter types are sent, so PostgreSQL infers each from the statement, and a binary
+// value would have to match that type exactly (e.g. an int32 compared with a bigint column
+// would be misread). So numbers and booleans are sent as text (format 0), which PostgreSQL
+// converts to whatever type it inferred; doubles are written with enough digits to round-trip.
+// Values are encoded as they're added, so the finished buffer is sent as it is.
+class QueryParams {
+	public:
+	QueryParams(){}
+
+	// any integer type (but not char, which is more likely meant as text, or bool)
+	template<typename T>
+	typename std::enable_if<std::is_integral<T>::value && not std::is_same<T, bool>::value &&
+	                        not std::is_same<T, char>::value, QueryParams&>::type Add(T value){
+		std::string text = std::to_string(value);
+		return Append(0, text.data(), text.size());
+	}
+	QueryParams& Add(double value){
+		char text[32];
+		int len;
+		if(std::isnan(value)) len = snprintf(text, sizeof(text), "NaN");
+		else if(std::isinf(value)) len = snprintf(text, sizeof(text), (value>0) ? "Infinity" : "-Infinity");
+		else len = snprintf(text, sizeof(text), "%.17g", value);
+		return Append(0, text, len);
+	}
+	QueryParams& Add(bool value){
+		return Append(0, (value) ? "t" : "f", 1);
+	}
+	QueryParams& Add(const std::string& value){
+		return Append(0, value.data(), value.size());
+	}
+	QueryParams& Add(const char* value){
+		return (value) ? Append(0, value, strlen(value)) : AddNull();
+	}
+	QueryParams& AddNull(){
+		AppendHeader(0, -1);
+		++n_params;
+		return *this;
+	}
+
+	uint32_t Size() const { return n_params; }
+	const std::string& Encoded() const { return encoded; }
+
+	private:
+	QueryParams& Append(int16_t format, const void* data, size_t len){
+		AppendHeader(format, (int32_t)len);
+		encoded.append(static_cast<const char*>(data), len);
+		++n_params;
+		return *this;
+	}
+	void AppendHeader(int16_t format, int32_t len){
+		uint16_t be_format = htobe16((uint16_t)format);
+		uint32_t be_len = htobe32((uint32_t)len);
+		encoded.append(reinterpret_cast<const char*>(&be_format), sizeof(be_format));
+		encoded.append(reinterpret_cast<const char*>(&be_len), sizeof(be_len));
+	}
+
+	std::string encoded;
+	uint32_t n_params = 0;
+};
+
+#endif
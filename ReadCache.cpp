@@ -0,0 +1,272 @@
+#include "ReadCache.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+ReadCache::ReadCache(size_t max_bytes_in, std::chrono::milliseconds default_ttl_in) :
+	max_bytes(max_bytes_in), default_ttl(default_ttl_in){
+	stats = Stats{0, 0, 0, 0, 0, 0, 0, 0};
+}
+
+std::string ReadCache::Lower(std::string str){
+	std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c){ return std::tolower(c); });
+	return str;
+}
+
+std::string ReadCache::Normalise(const std::string& query_string){
+	// collapse runs of whitespace outside of quotes, and drop any trailing semicolon,
+	// so trivially different spellings of a query share an entry
+	std::string normalised;
+	normalised.reserve(query_string.size());
+	char quote = 0;
+	bool space = false;
+	for(char c : query_string){
+		if(quote==0 && std::isspace((unsigned char)c)){
+			space = true;
+			continue;
+		}
+		if(space && not normalised.empty()) normalised += ' ';
+		space = false;
+		if(quote==0 && (c=='\'' || c=='"')) quote = c;
+		else if(c==quote) quote = 0;
+		normalised += c;
+	}
+	while(not normalised.empty() && (normalised.back()==';' || normalised.back()==' ')) normalised.pop_back();
+	return normalised;
+}
+
+std::string ReadCache::TableName(std::string name){
+	// a table name as written, without quotes or schema, so "public.run", "Public"."run" and
+	// run all refer to the same table. Tables of the same name in different schemas are
+	// treated as one, which only means some invalidations are unnecessary.
+	name.erase(std::remove(name.begin(), name.end(), '"'), name.end());
+	size_t dot = name.rfind('.');
+	if(dot!=std::string::npos) name.erase(0, dot+1);
+	return name;
+}
+
+std::vector<std::string> ReadCache::ReadTables(const std::string& query_string){
+	// the tables named after FROM and JOIN. Anything we can't make sense of is treated
+	// as uncacheable (no tables), since we couldn't invalidate it.
+	std::string query = Lower(query_string);
+	std::vector<std::string> tables;
+
+	const std::string delimiters = " \t\n,();";
+	size_t pos = 0;
+	std::string previous;
+	auto next_token = [&](bool& comma){
+		comma = false;
+		while(pos<query.size() && delimiters.find(query[pos])!=std::string::npos){
+			if(query[pos]==',') comma = true;
+			if(query[pos]=='(' || query[pos]==')') comma = false;
+			++pos;
+		}
+		size_t end = query.find_first_of(delimiters, pos);
+		if(end==std::string::npos) end = query.size();
+		std::string token = query.substr(pos, end-pos);
+		pos = end;
+		return token;
+	};
+
+	bool comma;
+	bool in_from = false;
+	while(pos<query.size()){
+		std::string token = next_token(comma);
+		if(token.empty()) break;
+		if(token=="from" || token=="join"){
+			in_from = true;
+		} else if(in_from && (previous=="from" || previous=="join" || comma)){
+			// FROM ONLY t reads t (without its child tables); the table is next
+			if(token=="only"){
+				previous = "from";
+				continue;
+			}
+			if(token=="select" || token=="lateral") return std::vector<std::string>{};  // subquery
+			// a table name, possibly quoted and/or schema qualified
+			tables.push_back(TableName(token));
+		} else if(token=="where" || token=="group" || token=="order" || token=="limit" || token=="on" || token=="union"){
+			in_from = false;
+		}
+		previous = token;
+	}
+
+	if(IsVolatile(query)) return std::vector<std::string>{};
+	return tables;
+}
+
+bool ReadCache::IsVolatile(const std::string& query_string){
+	// functions whose results change from one execution to the next, or that change something,
+	// and row locks. Functions of the database's own are unknown, so can't be caught here.
+	static const char* volatile_markers[] = {
+		"now()", "current_time", "current_date", "localtime", "clock_timestamp(", "statement_timestamp(",
+		"transaction_timestamp(", "timeofday(", "random(", "gen_random_uuid(", "uuid_generate",
+		"nextval(", "setval(", "currval(", "lastval(", "txid_current", "pg_current_xact_id(",
+		"pg_advisory", "pg_try_advisory", "pg_notify(", "set_config(", "pg_sleep",
+		"pg_cancel_backend(", "pg_terminate_backend(", "dblink", "lo_import(", "lo_export(", "lo_unlink(",
+		"for update", "for no key update", "for share", "for key share"};
+	std::string query = Lower(query_string);
+	for(const char* marker : volatile_markers){
+		if(query.find(marker)!=std::string::npos) return true;
+	}
+	return false;
+}
+
+std::string ReadCache::WriteTable(const std::string& query_string){
+	// the table named by INSERT INTO, UPDATE, DELETE FROM or TRUNCATE (each may be followed by ONLY)
+	std::string query = Lower(query_string);
+	size_t pos = std::string::npos;
+	const char* prefixes[] = {"insert into ", "update ", "delete from ", "truncate table ", "truncate "};
+	for(const char* prefix : prefixes){
+		pos = query.find(prefix);
+		if(pos!=std::string::npos){
+			pos += strlen(prefix);
+			break;
+		}
+	}
+	if(pos==std::string::npos) return "";
+	pos = query.find_first_not_of(" \t\n", pos);
+	if(pos!=std::string::npos && query.compare(pos, 5, "only ")==0) pos = query.find_first_not_of(" \t\n", pos+5);
+	if(pos==std::string::npos) return "";
+	size_t end = query.find_first_of(" \t\n(;", pos);
+	return TableName(query.substr(pos, (end==std::string::npos) ? std::string::npos : end-pos));
+}
+
+std::string ReadCache::Key(const std::string& dbname, const std::string& query_string){
+	if(ReadTables(query_string).empty()) return "";
+	return dbname+'\0'+Normalise(query_string);
+}
+
+uint64_t ReadCache::Epoch(){
+	std::lock_guard<std::mutex> lock(mtx);
+	return epoch;
+}
+
+bool ReadCache::Lookup(const std::string& key, ResultSet& result){
+	std::lock_guard<std::mutex> lock(mtx);
+	std::unordered_map<std::string, EntryRef>::iterator it = entries.find(key);
+	if(it==entries.end()){
+		++stats.misses;
+		return false;
+	}
+	if(it->second->expires<=std::chrono::steady_clock::now()){
+		Erase(it->second);
+		++stats.expirations;
+		++stats.misses;
+		return false;
+	}
+	// move to the front of the LRU list
+	lru.splice(lru.begin(), lru, it->second);
+	result = it->second->result;
+	++stats.hits;
+	return true;
+}
+
+void ReadCache::Insert(const std::string& key, const ResultSet& result, uint64_t read_epoch){
+	size_t dbname_end = key.find('\0');
+	std::string dbname = key.substr(0, dbname_end);
+	std::vector<std::string> tables = ReadTables(key.substr(dbname_end+1));
+	if(tables.empty()) return;
+
+	Entry entry;
+	entry.key = key;
+	entry.result = result;
+	entry.bytes = key.size() + result.Bytes() + sizeof(Entry);
+	std::chrono::milliseconds ttl = default_ttl;
+
+	std::lock_guard<std::mutex> lock(mtx);
+	if(entry.bytes>max_bytes) return;
+	// the result may predate a write to something it read
+	std::map<std::string, uint64_t>::iterator written = last_write.find(dbname);
+	if(written!=last_write.end() && written->second>read_epoch) return;
+	for(const std::string& table : tables){
+		entry.tables.push_back(dbname+'\0'+table);
+		written = last_write.find(entry.tables.back());
+		if(written!=last_write.end() && written->second>read_epoch) return;
+		std::map<std::string, std::chrono::milliseconds>::iterator ttl_it = ttls.find(entry.tables.back());
+		if(ttl_it!=ttls.end()) ttl = std::min(ttl, ttl_it->second);
+	}
+	std::sort(entry.tables.begin(), entry.tables.end());
+	entry.tables.erase(std::unique(entry.tables.begin(), entry.tables.end()), entry.tables.end());
+	if(ttl.count()<=0) return;
+	entry.expires = std::chrono::steady_clock::now() + ttl;
+
+	std::unordered_map<std::string, EntryRef>::iterator existing = entries.find(key);
+	if(existing!=entries.end()) Erase(existing->second);
+
+	// make room, least recently used first
+	while(bytes+entry.bytes>max_bytes && not lru.empty()){
+		Erase(std::prev(lru.end()));
+		++stats.evictions;
+	}
+
+	bytes += entry.bytes;
+	lru.push_front(std::move(entry));
+	entries.emplace(key, lru.begin());
+	for(const std::string& table : lru.front().tables) by_table.emplace(table, lru.begin());
+	++stats.insertions;
+}
+
+void ReadCache::Erase(EntryRef entry){
+	for(const std::string& table : entry->tables){
+		auto range = by_table.equal_range(table);
+		for(auto it=range.first; it!=range.second; ++it){
+			if(it->second==entry){
+				by_table.erase(it);
+				break;
+			}
+		}
+	}
+	entries.erase(entry->key);
+	bytes -= entry->bytes;
+	lru.erase(entry);
+}
+
+void ReadCache::Invalidate(const std::string& dbname, const std::string& table){
+	std::lock_guard<std::mutex> lock(mtx);
+	++epoch;
+	if(table.empty()){
+		// don't know what was written; drop everything for this database
+		last_write[dbname] = epoch;
+		std::string prefix = dbname+'\0';
+		for(EntryRef it=lru.begin(); it!=lru.end(); ){
+			EntryRef next = std::next(it);
+			if(it->key.compare(0, prefix.size(), prefix)==0){
+				Erase(it);
+				++stats.invalidations;
+			}
+			it = next;
+		}
+		return;
+	}
+	std::string table_key = dbname+'\0'+table;
+	last_write[table_key] = epoch;
+	auto range = by_table.equal_range(table_key);
+	std::vector<EntryRef> stale;
+	for(auto it=range.first; it!=range.second; ++it) stale.push_back(it->second);
+	for(EntryRef entry : stale){
+		Erase(entry);
+		++stats.invalidations;
+	}
+}
+
+void ReadCache::SetTTL(const std::string& dbname, const std::string& table, std::chrono::milliseconds ttl){
+	std::lock_guard<std::mutex> lock(mtx);
+	ttls[dbname+'\0'+TableName(Lower(table))] = ttl;
+}
+
+ReadCache::Stats ReadCache::GetStats(){
+	std::lock_guard<std::mutex> lock(mtx);
+	Stats current = stats;
+	current.entries = entries.size();
+	current.bytes = bytes;
+	return current;
+}
+
+void ReadCache::Clear(){
+	std::lock_guard<std::mutex> lock(mtx);
+	++epoch;
+	lru.clear();
+	entries.clear();
+	by_table.clear();
+	bytes = 0;
+}
@@ -0,0 +1,90 @@
+#ifndef READCACHE_H
+#define READCACHE_H
+
+#include "ResultSet.h"
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+
+// Client-side cache of read query results, so identical reads repeated by different tools
+// (run numbers, tool configs...) don't each need a round trip to the middleman.
+// Entries are keyed on database and normalised query text, and expire after a TTL,
+// which may be set per table (an entry uses the shortest TTL of the tables it reads).
+// Writes sent by this client invalidate entries reading the tables they write to;
+// writes by other clients are only picked up once entries expire.
+// The least recently used entries are evicted to keep within a limit on bytes held.
+// Results are held as ResultSets, which share their frames, so hits don't copy rows.
+// Called from both client threads (Lookup) and the background thread, so guarded by a mutex.
+class ReadCache {
+	public:
+	ReadCache(size_t max_bytes_in, std::chrono::milliseconds default_ttl_in);
+
+	struct Stats {
+		long hits;
+		long misses;
+		long insertions;
+		long evictions;       // to stay within max_bytes
+		long expirations;
+		long invalidations;   // entries dropped because of a write
+		size_t entries;
+		size_t bytes;
+	};
+
+	// the cache key for a read, or "" if it can't be cached (no tables could be identified).
+	// Cacheable reads should get Epoch() before they're sent, and pass it to Insert.
+	std::string Key(const std::string& dbname, const std::string& query_string);
+	uint64_t Epoch();
+
+	bool Lookup(const std::string& key, ResultSet& result);
+	// store the result of a read sent at 'epoch'. Dropped if a table it reads has been
+	// invalidated since, as the result may predate the write.
+	void Insert(const std::string& key, const ResultSet& result, uint64_t epoch);
+
+	// drop entries that read the table written to by a write query (all of dbname if unknown)
+	void Invalidate(const std::string& dbname, const std::string& table);
+	// the table a write query writes to (without any schema), or "" if it can't be determined
+	static std::string WriteTable(const std::string& query_string);
+	// whether a read may give a different result each time it's run, or has side effects
+	// (e.g. nextval, random, now, FOR UPDATE, advisory locks), so can't be cached or shared
+	static bool IsVolatile(const std::string& query_string);
+
+	void SetTTL(const std::string& dbname, const std::string& table, std::chrono::milliseconds ttl);
+	Stats GetStats();
+	void Clear();
+
+	private:
+	static std::string Normalise(const std::string& query_string);
+	static std::vector<std::string> ReadTables(const std::string& query_string);
+	static std::string Lower(std::string str);
+	static std::string TableName(std::string name);
+
+	struct Entry {
+		std::string key;
+		ResultSet result;
+		std::vector<std::string> tables;   // dbname+'\0'+table for each table read
+		std::chrono::steady_clock::time_point expires;
+		size_t bytes;
+	};
+	typedef std::list<Entry>::iterator EntryRef;
+	void Erase(EntryRef entry);
+
+	std::mutex mtx;
+	std::list<Entry> lru;                        // most recently used first
+	std::unordered_map<std::string, EntryRef> entries;
+	std::unordered_multimap<std::string, EntryRef> by_table;
+	std::map<std::string, std::chrono::milliseconds> ttls;   // by dbname+'\0'+table
+	size_t max_bytes;
+	size_t bytes = 0;
+	std::chrono::milliseconds default_ttl;
+	uint64_t epoch = 0;                          // bumped by each invalidation
+	std::map<std::string, uint64_t> last_write;  // epoch of the last invalidation, by dbname+'\0'+table or dbname
+	Stats stats;
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef RESULTSET_H
+#define RESULTSET_H
+
+#include "zmq.hpp"
+#include "boost/utility/string_view.hpp"
+
+#include <memory>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <stdexcept>
+
+// Rows returned by a query, kept in the zmq frames they were received in.
+// Each row is one frame; rows are exposed as string_views into the frame data,
+// with the length taken from the frame rather than by scanning for a terminating null,
+// and are only copied if the caller asks for a std::string.
+// The frames are shared, so copying a ResultSet (or the Query holding it) is cheap,
+// and a view stays valid for as long as any ResultSet referring to its frames exists.
+class ResultSet {
+	public:
+	ResultSet() : first_row(0){}
+
+	// take ownership of received frames; rows start at frame first_row_in
+	ResultSet(std::vector<zmq::message_t>&& frames_in, size_t first_row_in) :
+		frames(std::make_shared<std::vector<zmq::message_t>>(std::move(frames_in))),
+		first_row(first_row_in){
+		if(first_row > frames->size()) first_row = frames->size();
+	}
+
+	size_t size() const { return (frames) ? frames->size() - first_row : 0; }
+	bool empty() const { return size()==0; }
+	// memory held by the frames
+	size_t Bytes() const {
+		size_t bytes = 0;
+		if(frames) for(const zmq::message_t& frame : *frames) bytes += frame.size() + sizeof(frame);
+		return bytes;
+	}
+
+	// view of row i. Any null terminator sent by the middleman is not included.
+	boost::string_view operator[](size_t i) const {
+		const zmq::message_t& frame = (*frames)[first_row + i];
+		size_t len = frame.size();
+		const char* data = static_cast<const char*>(frame.data());
+		if(len>0 && data[len-1]=='\0') --len;
+		return boost::string_view(data, len);
+	}
+	boost::string_view at(size_t i) const {
+		if(i>=size()) throw std::out_of_range("ResultSet::at: row "+std::to_string(i)+" of "+std::to_string(size()));
+		return (*this)[i];
+	}
+	boost::string_view front() const { return at(0); }
+
+	// copy of row i
+	std::string String(size_t i) const {
+		boost::string_view row = at(i);
+		return std::string(row.data(), row.size());
+	}
+
+	// copy all rows into strings, for callers wanting the traditional vector of rows
+	void CopyTo(std::vector<std::string>& rows) const {
+		rows.clear();
+		rows.reserve(size());
+		for(size_t i=0; i<size(); ++i){
+			boost::string_view row = (*this)[i];
+			rows.emplace_back(row.data(), row.size());
+		}
+	}
+
+	// forward iteration over row views
+	class const_iterator {
+		public:
+		const_iterator(const ResultSet* set_in, size_t i_in) : set(set_in), i(i_in){}
+		boost::string_view operator*() const { return (*set)[i]; }
+		const_iterator& operator++(){ ++i; return *this; }
+		bool operator==(const const_iterator& other) const { return i==other.i; }
+		bool operator!=(const const_iterator& other) const { return i!=other.i; }
+		private:
+		const ResultSet* set;
+		size_t i;
+	};
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, size()); }
+
+	private:
+	std::shared_ptr<std::vector<zmq::message_t>> frames;
+	size_t first_row;
+};
+
+#endif
@@ -0,0 +1,211 @@
+// latency benchmark for PGClient against local stand-in middlemen.
+// For each concurrency level (the number of queries kept in flight at once) it runs the same
+// load for a while, and reports the throughput and the latency percentiles seen by the caller,
+// from submitting each query to its callback. The client, middlemen and load all run in this
+// process over loopback, so it needs no network, middleman or database, and the results from
+// different builds of PGClient can be compared directly.
+// The load and the middlemen's behaviour are set with the bench_ options in the config file.
+// Results are printed, and written as JSON to the file given.
+#include "PGClient.h"
+#include "DataModel.h"
+#include "FakeMiddleman.h"
+#include "LatencyHistogram.h"
+#include "Store.h"
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <random>
+
+struct BenchOptions {
+	std::vector<int> concurrency{1, 4, 16, 64, 256};
+	int seconds = 5;           // measured time at each level
+	int warmup_ms = 500;       // unmeasured time at each level, first
+	int middlemen = 1;
+	int rows = 1;              // rows returned for each read
+	int row_size = 32;         // bytes per row
+	int latency_us = 0;        // time the middlemen take to answer each read
+	double slow_fraction = 0;  // fraction of reads answered slow_ms later still
+	int slow_ms = 0;
+	double write_fraction = 0; // fraction of queries that are INSERTs rather than SELECTs
+};
+
+struct LevelResult {
+	int concurrency;
+	long queries;              // completed in the measured time
+	long failed;
+	double qps;
+	double mean_us;
+	uint64_t p50_us;
+	uint64_t p99_us;
+	uint64_t p999_us;
+	uint64_t max_us;
+};
+
+LevelResult RunLevel(PGClient& client, const BenchOptions& options, int concurrency){
+
+	LatencyHistogram latencies;
+	std::atomic<long> outstanding{0};
+	std::atomic<long> completed{0};
+	std::atomic<long> failed{0};
+	std::mt19937 rng(concurrency);
+	std::uniform_real_distribution<double> uniform(0, 1);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point measure_from = start + std::chrono::milliseconds(options.warmup_ms);
+	std::chrono::steady_clock::time_point measure_to = measure_from + std::chrono::seconds(options.seconds);
+
+	for(long i=0; ; ++i){
+		// keep up to 'concurrency' queries in flight at once
+		while(outstanding.load()>=concurrency) std::this_thread::yield();
+		std::chrono::steady_clock::time_point submitted = std::chrono::steady_clock::now();
+		if(submitted>=measure_to) break;
+		bool measured = (submitted>=measure_from);
+		QueryCallback callback = [&, submitted, measured](Query& qry){
+			if(measured){
+				if(not qry.success) ++failed;
+				latencies.Record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-submitted).count());
+				++completed;
+			}
+			--outstanding;
+		};
+		// distinct queries, so identical reads in flight aren't combined
+		std::string query = (options.write_fraction>0 && uniform(rng)<options.write_fraction)
+		                  ? "INSERT INTO monitoring (id, value) VALUES ("+std::to_string(i)+", 0)"
+		                  : "SELECT * FROM monitoring WHERE id="+std::to_string(i);
+		++outstanding;
+		if(not client.SubmitQuery("monitoringdb", query, callback)){
+			--outstanding;
+			if(measured) ++failed;
+		}
+	}
+	while(outstanding.load()>0) std::this_thread::yield();
+
+	LatencyHistogram::Snapshot snapshot = latencies.Take();
+	LevelResult result;
+	result.concurrency = concurrency;
+	result.queries = completed.load();
+	result.failed = failed.load();
+	result.qps = result.queries/double(options.seconds);
+	result.mean_us = (snapshot.Count()>0) ? snapshot.sum/double(snapshot.Count()) : 0;
+	result.p50_us = snapshot.Percentile(0.5);
+	result.p99_us = snapshot.Percentile(0.99);
+	result.p999_us = snapshot.Percentile(0.999);
+	result.max_us = snapshot.Percentile(1.0);
+	return result;
+}
+
+std::string ToJSON(const BenchOptions& options, const std::vector<LevelResult>& results){
+	std::ostringstream out;
+	// options as given (fractions are often small), rates and means to 1dp
+	out<<"{\n  \"benchmark\": \"loadbench\",\n  \"options\": {"
+	   <<"\"seconds\": "<<options.seconds<<", \"warmup_ms\": "<<options.warmup_ms
+	   <<", \"middlemen\": "<<options.middlemen<<", \"rows\": "<<options.rows<<", \"row_size\": "<<options.row_size
+	   <<", \"latency_us\": "<<options.latency_us<<", \"slow_fraction\": "<<options.slow_fraction
+	   <<", \"slow_ms\": "<<options.slow_ms<<", \"write_fraction\": "<<options.write_fraction<<"},\n  \"results\": [";
+	for(size_t i=0; i<results.size(); ++i){
+		const LevelResult& result = results.at(i);
+		out<<((i>0) ? "," : "")<<"\n    {\"concurrency\": "<<result.concurrency<<", \"queries\": "<<result.queries
+		   <<", \"failed\": "<<result.failed<<std::fixed<<std::setprecision(1)<<", \"qps\": "<<result.qps
+		   <<", \"latency_us\": {\"mean\": "<<result.mean_us
+		   <<", \"p50\": "<<result.p50_us<<", \"p99\": "<<result.p99_us<<", \"p999\": "<<result.p999_us
+		   <<", \"max\": "<<result.max_us<<"}}";
+	}
+	out<<"\n  ]\n}\n";
+	return out.str();
+}
+
+int main(int argc, const char** argv){
+
+	if(argc<2){
+		std::cout<<"usage: "<<argv[0]<<" <configfile> [results.json]"<<std::endl;
+		return 0;
+	}
+	std::string configfile = argv[1];
+	std::string resultsfile = (argc>2) ? argv[2] : "";
+
+	Store config;
+	config.Initialise(configfile);
+	int clt_dlr_port=77777, clt_pub_port=77778;
+	config.Get("clt_dlr_port",clt_dlr_port);
+	config.Get("clt_pub_port",clt_pub_port);
+	BenchOptions options;
+	std::string concurrency;
+	if(config.Get("bench_concurrency",concurrency)){
+		// a comma separated list
+		options.concurrency.clear();
+		std::stringstream levels(concurrency);
+		std::string level;
+		while(std::getline(levels, level, ',')) if(not level.empty()) options.concurrency.push_back(std::stoi(level));
+	}
+	config.Get("bench_seconds",options.seconds);
+	config.Get("bench_warmup_ms",options.warmup_ms);
+	config.Get("bench_middlemen",options.middlemen);
+	config.Get("bench_rows",options.rows);
+	config.Get("bench_row_size",options.row_size);
+	config.Get("bench_latency_us",options.latency_us);
+	config.Get("bench_slow_fraction",options.slow_fraction);
+	config.Get("bench_slow_ms",options.slow_ms);
+	config.Get("bench_write_fraction",options.write_fraction);
+
+	PGClient client;
+	if(not client.Initialise(configfile)){
+		std::cerr<<"failed to initialise PGClient"<<std::endl;
+		return 1;
+	}
+
+	zmq::context_t context(1);
+	std::vector<FakeMiddleman*> middlemen;
+	for(int i=0; i<options.middlemen; ++i){
+		middlemen.push_back(new FakeMiddleman(&context, "127.0.0.1", clt_dlr_port, clt_pub_port));
+		middlemen.back()->SetRows(options.rows, options.row_size);
+		middlemen.back()->SetLatency(options.latency_us);
+		middlemen.back()->SetSlowFraction(options.slow_fraction, options.slow_ms);
+		middlemen.back()->Start();
+	}
+
+	// wait until the middlemen have connected and are answering
+	std::vector<std::string> results;
+	std::string err;
+	int timeout = 100;
+	for(int i=0; i<100; ++i){
+		if(client.SendQuery("monitoringdb", "SELECT 1", &results, &timeout, &err)) break;
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	std::vector<LevelResult> level_results;
+	for(int concurrency : options.concurrency){
+		level_results.push_back(RunLevel(client, options, concurrency));
+		if(level_results.back().failed>0) std::cerr<<level_results.back().failed<<" queries failed with concurrency "<<concurrency<<std::endl;
+	}
+
+	client.Finalise();
+	for(FakeMiddleman* middleman : middlemen){
+		middleman->Stop();
+		delete middleman;
+	}
+
+	std::cout<<"\n"<<options.middlemen<<" middlemen, "<<options.rows<<" rows of "<<options.row_size<<" bytes per read, "
+	         <<options.latency_us<<"us to answer, "<<options.write_fraction*100<<"% writes\n";
+	std::cout<<std::setw(12)<<"concurrency"<<std::setw(14)<<"queries/s"<<std::setw(10)<<"p50 us"
+	         <<std::setw(10)<<"p99 us"<<std::setw(10)<<"p999 us"<<std::setw(10)<<"max us"<<std::setw(10)<<"failed"<<std::endl;
+	for(const LevelResult& result : level_results){
+		std::cout<<std::setw(12)<<result.concurrency<<std::setw(14)<<std::fixed<<std::setprecision(0)<<result.qps
+		         <<std::setw(10)<<result.p50_us<<std::setw(10)<<result.p99_us<<std::setw(10)<<result.p999_us
+		         <<std::setw(10)<<result.max_us<<std::setw(10)<<result.failed<<std::endl;
+	}
+
+	if(not resultsfile.empty()){
+		std::ofstream out(resultsfile);
+		out<<ToJSON(options, level_results);
+		if(not out){
+			std::cerr<<"failed to write results to "<<resultsfile<<std::endl;
+			return 1;
+		}
+		std::cout<<"results written to "<<resultsfile<<std::endl;
+	}
+
+	return 0;
+}
@@ -0,0 +1,146 @@
+// stress benchmark for the PGClient submission queue.
+// measures submission throughput as the number of producer threads increases,
+// comparing the lock-free MPSCQueue against a mutex-guarded std::queue.
+// Also reports the tail latency of a single push (sampled), which is what a thread
+// calling SendQuery sees: a producer preempted while holding the mutex stalls every
+// other producer and the consumer, even when average throughput is the same.
+#include "MPSCQueue.h"
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <queue>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+// stand-in for the Query objects submitted by PGClient::DoQuery
+struct Submission {
+	std::string dbname;
+	std::string query_string;
+	int id;
+};
+
+// mutex-guarded equivalent of the old waiting_senders queue, for reference
+class LockedQueue {
+	public:
+	LockedQueue(size_t capacity_in) : capacity(capacity_in){}
+	bool TryPush(Submission&& item){
+		std::lock_guard<std::mutex> lock(mtx);
+		if(items.size()>=capacity) return false;
+		items.push(std::move(item));
+		return true;
+	}
+	bool TryPop(Submission& item){
+		std::lock_guard<std::mutex> lock(mtx);
+		if(items.empty()) return false;
+		item = std::move(items.front());
+		items.pop();
+		return true;
+	}
+	private:
+	std::mutex mtx;
+	std::queue<Submission> items;
+	size_t capacity;
+};
+
+struct Result {
+	double rate;      // pushes per second
+	double p99_ns;    // push latency
+	double max_ns;
+};
+
+// one in this many pushes is timed
+const int sample_every = 16;
+
+template <typename Q>
+Result RunBenchmark(int n_producers, int n_per_producer, size_t capacity){
+	Q queue(capacity);
+	std::atomic<bool> go{false};
+	std::vector<std::thread> producers;
+	std::vector<std::vector<double>> samples(n_producers);
+
+	for(int p=0; p<n_producers; ++p){
+		producers.emplace_back([&queue, &go, &samples, p, n_per_producer](){
+			std::vector<double>& times = samples.at(p);
+			times.reserve(n_per_producer/sample_every+1);
+			while(!go.load(std::memory_order_acquire)) std::this_thread::yield();
+			for(int i=0; i<n_per_producer; ++i){
+				Submission sub{"monitoringdb", "SELECT 1", p*n_per_producer+i};
+				// spin if the consumer is behind; the benchmark measures sustained throughput.
+				// Only the successful push is timed, not the waiting for room.
+				if(i%sample_every==0){
+					while(true){
+						std::chrono::steady_clock::time_point before = std::chrono::steady_clock::now();
+						bool pushed = queue.TryPush(std::move(sub));
+						std::chrono::steady_clock::time_point after = std::chrono::steady_clock::now();
+						if(pushed){
+							times.push_back(std::chrono::duration<double, std::nano>(after-before).count());
+							break;
+						}
+						std::this_thread::yield();
+					}
+				} else {
+					while(not queue.TryPush(std::move(sub))) std::this_thread::yield();
+				}
+			}
+		});
+	}
+
+	long total = (long)n_producers * n_per_producer;
+	long received = 0;
+	Submission sub;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	go.store(true, std::memory_order_release);
+	while(received<total){
+		if(queue.TryPop(sub)) ++received;
+	}
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+	for(std::thread& t : producers) t.join();
+
+	std::vector<double> times;
+	for(std::vector<double>& producer_times : samples) times.insert(times.end(), producer_times.begin(), producer_times.end());
+	std::sort(times.begin(), times.end());
+	Result result;
+	result.rate = total/std::chrono::duration<double>(end-start).count();
+	result.p99_ns = times.empty() ? 0 : times.at(times.size()*99/100);
+	result.max_ns = times.empty() ? 0 : times.back();
+	return result;
+}
+
+int main(int argc, const char** argv){
+
+	int total_queries = 2000000;
+	size_t capacity = 8192;
+	if(argc>1) total_queries = std::stoi(argv[1]);
+	if(argc>2) capacity = std::stoul(argv[2]);
+
+	std::cout<<"submitting "<<total_queries<<" queries per run, queue capacity "<<capacity<<"\n"
+	         <<"hardware threads: "<<std::thread::hardware_concurrency()<<"\n\n";
+	std::cout<<std::setw(10)<<""
+	         <<std::setw(36)<<"MPSCQueue"
+	         <<std::setw(36)<<"mutex queue"<<"\n"
+	         <<std::setw(10)<<"producers"
+	         <<std::setw(12)<<"Mq/s"<<std::setw(12)<<"p99 ns"<<std::setw(12)<<"max us"
+	         <<std::setw(12)<<"Mq/s"<<std::setw(12)<<"p99 ns"<<std::setw(12)<<"max us"
+	         <<std::setw(10)<<"ratio"<<std::endl;
+
+	for(int n_producers=1; n_producers<=64; n_producers*=2){
+		int n_per_producer = total_queries/n_producers;
+		Result lockfree = RunBenchmark<MPSCQueue<Submission>>(n_producers, n_per_producer, capacity);
+		Result locked = RunBenchmark<LockedQueue>(n_producers, n_per_producer, capacity);
+		std::cout<<std::setw(10)<<n_producers<<std::fixed
+		         <<std::setw(12)<<std::setprecision(2)<<lockfree.rate/1E6
+		         <<std::setw(12)<<std::setprecision(0)<<lockfree.p99_ns
+		         <<std::setw(12)<<std::setprecision(1)<<lockfree.max_ns/1E3
+		         <<std::setw(12)<<std::setprecision(2)<<locked.rate/1E6
+		         <<std::setw(12)<<std::setprecision(0)<<locked.p99_ns
+		         <<std::setw(12)<<std::setprecision(1)<<locked.max_ns/1E3
+		         <<std::setw(10)<<std::setprecision(2)<<lockfree.rate/locked.rate<<std::endl;
+	}
+
+	return 0;
+}
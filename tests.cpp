@@ -0,0 +1,467 @@
+// regression tests for PGClient, run against local stand-in middlemen (FakeMiddleman), so they
+// need no network, middleman or database. Each test appends its options to a copy of the given
+// config, which must set the client's ports.
+// usage: tests <configfile>; exits non-zero if any test fails.
+#include "PGClient.h"
+#include "DataModel.h"
+#include "FakeMiddleman.h"
+#include "Store.h"
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <memory>
+
+static int failures = 0;
+
+#define CHECK(condition) do{ \
+	if(not (condition)){ \
+		std::cerr<<__FILE__<<":"<<__LINE__<<": "<<__func__<<": check failed: "<<#condition<<std::endl; \
+		++failures; \
+	} \
+}while(0)
+
+struct TestSetup {
+	std::string configfile;
+	int clt_dlr_port = 77777;
+	int clt_pub_port = 77778;
+
+	// a copy of the base config with these options added
+	std::string Config(const std::string& name, const std::string& options){
+		std::string tmpconfig = configfile+".tests."+name;
+		std::ifstream in(configfile);
+		std::ofstream out(tmpconfig);
+		out<<in.rdbuf()<<"\n"<<options<<"\n";
+		return tmpconfig;
+	}
+};
+
+// wait until the condition holds, for up to timeout_ms. Returns whether it did.
+static bool WaitFor(std::function<bool()> condition, int timeout_ms=5000){
+	std::chrono::steady_clock::time_point give_up = std::chrono::steady_clock::now()+std::chrono::milliseconds(timeout_ms);
+	while(not condition()){
+		if(std::chrono::steady_clock::now()>=give_up) return false;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return true;
+}
+
+// a client, with the given options added to the base config, and the middlemen answering it.
+// Set the middlemen up, then Start them; everything is stopped and cleaned up on destruction.
+struct TestRig {
+	TestRig(TestSetup& setup, const std::string& name, const std::string& options, int n_middlemen) : context(1) {
+		config = setup.Config(name, options);
+		initialised = client.Initialise(config);
+		for(int i=0; i<n_middlemen; ++i){
+			middlemen.emplace_back(new FakeMiddleman(&context, "127.0.0.1", setup.clt_dlr_port, setup.clt_pub_port));
+		}
+	}
+	~TestRig(){
+		client.Finalise();
+		for(std::unique_ptr<FakeMiddleman>& middleman : middlemen) middleman->Stop();
+		remove(config.c_str());
+	}
+	FakeMiddleman& Middleman(size_t i){ return *middlemen.at(i); }
+	
+	// start the middlemen and wait until each has answered a read, and if a write is given,
+	// taken that write (retried until they have), so they're known to be connected.
+	// These probes count towards the middlemen's totals.
+	bool Start(const std::string& probe_write=""){
+		// counts carry over a restart, so wait for them to go up
+		std::vector<long> answered, written;
+		for(std::unique_ptr<FakeMiddleman>& middleman : middlemen){
+			answered.push_back(middleman->QueriesAnswered());
+			written.push_back(middleman->WriteMessagesReceived());
+			middleman->Start();
+		}
+		return WaitFor([&](){
+			std::string result, err;
+			int timeout = 5000;
+			client.SendQuery("rundb", "SELECT 1", &result, &timeout, &err);
+			if(not probe_write.empty()) client.SendQuery("rundb", probe_write, &result, &timeout, &err);
+			for(size_t i=0; i<middlemen.size(); ++i){
+				if(middlemen.at(i)->QueriesAnswered()==answered.at(i)) return false;
+				if(not probe_write.empty() && middlemen.at(i)->WriteMessagesReceived()==written.at(i)) return false;
+			}
+			return true;
+		}, 20000);
+	}
+	// stop the middlemen, change their settings, and start them again
+	bool Restart(std::function<void(FakeMiddleman&)> configure){
+		for(std::unique_ptr<FakeMiddleman>& middleman : middlemen){
+			middleman->Stop();
+			configure(*middleman);
+		}
+		return Start();
+	}
+	
+	zmq::context_t context;
+	std::vector<std::unique_ptr<FakeMiddleman>> middlemen;
+	PGClient client;
+	std::string config;
+	bool initialised;
+};
+
+// streams a read to completion, returning whether it succeeded and how many rows it had
+static bool Stream(PGClient& client, long& rows, std::string& err){
+	std::atomic<long> received{0};
+	std::atomic<bool> done{false};
+	bool success = false;
+	int timeout = 1000;
+	rows = 0;
+	if(not client.SubmitStreamingQuery("rundb", "SELECT * FROM run",
+	                                   [&received](const ResultSet& chunk){ received += chunk.size(); return true; },
+	                                   [&](Query& qry){ success = qry.success; err = qry.err; done = true; },
+	                                   &timeout, &err)){
+		return false;
+	}
+	while(not done) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	rows = received;
+	return success;
+}
+
+void TestStreamingAcrossMiddlemen(TestSetup& setup){
+	// flow control for a streaming read must go back to the middleman sending its chunks,
+	// not to whichever is next in turn, or the stream stalls once its window is used up.
+	for(std::string routing : {"round_robin", "p2c"}){
+		TestRig rig(setup, "streaming", "read_routing "+routing+"\nstream_chunk_rows 10\nstream_window 2", 2);
+		CHECK(rig.initialised);
+		rig.Middleman(0).SetRows(200, 32);
+		rig.Middleman(1).SetRows(200, 32);
+		CHECK(rig.Start());
+		long answered = rig.Middleman(0).QueriesAnswered()+rig.Middleman(1).QueriesAnswered();
+
+		long rows;
+		std::string err;
+		if(routing=="round_robin"){
+			// the dealer socket can't address a middleman, so streaming is refused
+			CHECK(not Stream(rig.client, rows, err));
+			CHECK(not err.empty());
+		} else {
+			// enough streams that both middlemen serve some
+			for(int i=0; i<10; ++i){
+				CHECK(Stream(rig.client, rows, err));
+				CHECK(rows==200);
+			}
+			CHECK(rig.Middleman(0).QueriesAnswered()+rig.Middleman(1).QueriesAnswered()==answered+10);
+		}
+	}
+}
+
+void TestReadCacheSchemas(TestSetup&){
+	// a write invalidates cached reads of the same table however either names it:
+	// with or without a schema, quoted or not, or with ONLY
+	CHECK(ReadCache::WriteTable("INSERT INTO public.run VALUES (1)")=="run");
+	CHECK(ReadCache::WriteTable("UPDATE ONLY run SET x=1")=="run");
+	CHECK(ReadCache::WriteTable("DELETE FROM ONLY \"public\".\"run\" WHERE x=1")=="run");
+	CHECK(ReadCache::WriteTable("TRUNCATE TABLE ONLY public.run")=="run");
+
+	const char* reads[] = {"SELECT * FROM run", "SELECT * FROM public.run", "SELECT * FROM ONLY public.run",
+	                       "SELECT * FROM config, ONLY run WHERE config.id=run.id"};
+	const char* writes[] = {"INSERT INTO run VALUES (1)", "INSERT INTO public.run VALUES (1)", "UPDATE ONLY public.run SET x=1"};
+	for(const char* read : reads){
+		for(const char* write : writes){
+			ReadCache cache(1<<20, std::chrono::milliseconds(60000));
+			std::string key = cache.Key("rundb", read);
+			CHECK(not key.empty());
+			cache.Insert(key, ResultSet(), cache.Epoch());
+			ResultSet result;
+			CHECK(cache.Lookup(key, result));
+			cache.Invalidate("rundb", ReadCache::WriteTable(write));
+			if(cache.Lookup(key, result)) std::cerr<<"'"<<write<<"' didn't invalidate '"<<read<<"'"<<std::endl;
+			CHECK(not cache.Lookup(key, result));
+		}
+	}
+}
+
+void TestLookupKeys(TestSetup& setup){
+	// batched lookups must give each key just its own rows, whatever characters the keys hold
+	TestRig rig(setup, "lookups", "lookup_batch_delay_ms 50", 1);
+	CHECK(rig.initialised);
+	rig.Middleman(0).SetRows(3, 16);
+	CHECK(rig.Start());
+
+	std::string err;
+	uint32_t lookup_id = rig.client.RegisterLookup("rundb", "SELECT config FROM runs WHERE name = $1", &err);
+	CHECK(lookup_id!=0);
+	std::vector<std::string> keys{"a", "a\tb", "b", "a:3", "1:x", "\"q'\\", ""};
+	std::vector<size_t> rows(keys.size(), 0);
+	std::atomic<size_t> done{0};
+	for(size_t i=0; i<keys.size(); ++i){
+		CHECK(rig.client.SubmitLookup(lookup_id, keys.at(i), [&rows, &done, i](Query& qry){
+			if(qry.success) rows.at(i) = qry.query_response.size();
+			++done;
+		}, nullptr, &err));
+	}
+	while(done<keys.size()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	for(size_t i=0; i<keys.size(); ++i){
+		if(rows.at(i)!=3) std::cerr<<"key '"<<keys.at(i)<<"' got "<<rows.at(i)<<" rows"<<std::endl;
+		CHECK(rows.at(i)==3);
+	}
+}
+
+void TestWritesNotResentByDefault(TestSetup& setup){
+	// a write without an acknowledgement isn't sent again, as if only the acknowledgement was
+	// lost that would apply it twice, unless resend_writes says the middlemen can tell
+	for(int resend_writes : {0, 1}){
+		TestRig rig(setup, "resends", "max_retries 3\nresend_period_ms 20\nresend_writes "+std::to_string(resend_writes), 1);
+		CHECK(rig.initialised);
+		FakeMiddleman& middleman = rig.Middleman(0);
+		middleman.SetDropRate(0.5);
+		CHECK(rig.Start("INSERT INTO ready VALUES (1)"));
+		long applied = middleman.WritesReceived();
+		long resent = rig.client.ResentQueries();
+		
+		const int writes = 40;
+		for(int i=0; i<writes; ++i){
+			std::string result, err;
+			int timeout = 100;
+			rig.client.SendQuery("rundb", "INSERT INTO run VALUES ("+std::to_string(i)+")", &result, &timeout, &err);
+		}
+		// half are lost on the way, so without resends that many are never applied
+		if(resend_writes){
+			CHECK(rig.client.ResentQueries()>resent);
+			CHECK(WaitFor([&](){ return middleman.WritesReceived()-applied>writes*3/4; }));
+		} else {
+			CHECK(rig.client.ResentQueries()==resent);
+			CHECK(middleman.WritesReceived()-applied<writes*3/4);
+		}
+	}
+}
+
+void TestHedgesWithoutRetries(TestSetup& setup){
+	// a hedged read sends the same statement again, even if it was handed to zmq without
+	// copying and wouldn't otherwise be resent
+	TestRig rig(setup, "hedges", "read_routing p2c\nhedge_reads 1\nmax_retries 0\nzero_copy_threshold 64", 2);
+	CHECK(rig.initialised);
+	rig.Middleman(0).SetSlowFraction(0.02, 50);
+	rig.Middleman(1).SetSlowFraction(0.02, 50);
+	CHECK(rig.Start());
+	
+	// hedging starts once there are enough latencies to know what's slow
+	int failed = 0;
+	for(int i=0; i<1500; ++i){
+		std::vector<std::string> results;
+		std::string err;
+		int timeout = 1000;
+		if(not rig.client.SendQuery("rundb", "SELECT * FROM run WHERE id="+std::to_string(i)+" /* long enough not to be copied */", &results, &timeout, &err)) ++failed;
+	}
+	CHECK(rig.client.HedgedReads()>0);
+	CHECK(failed==0);
+}
+
+void TestRoutingWithoutMiddlemen(TestSetup& setup){
+	// with read_routing, reads fail until a middleman has announced itself, and say why
+	TestRig rig(setup, "nopeers", "read_routing least_outstanding", 0);
+	CHECK(rig.initialised);
+	std::vector<std::string> results;
+	std::string err;
+	int timeout = 100;
+	CHECK(not rig.client.SendQuery("rundb", "SELECT 1", &results, &timeout, &err));
+	CHECK(err.find("ZMQ_PROBE_ROUTER")!=std::string::npos);
+}
+
+void TestSingleFlightReads(TestSetup& setup){
+	// identical reads in flight share one request, unless each execution may differ,
+	// or one was sent before a write that the other, made after it was acknowledged, must see
+	CHECK(ReadCache::IsVolatile("SELECT nextval('run_id_seq')"));
+	CHECK(ReadCache::IsVolatile("SELECT * FROM run WHERE id=1 FOR UPDATE"));
+	CHECK(ReadCache::IsVolatile("SELECT pg_advisory_lock(1)"));
+	CHECK(ReadCache::IsVolatile("SELECT * FROM run WHERE start > NOW()"));
+	CHECK(not ReadCache::IsVolatile("SELECT * FROM run WHERE id=1"));
+	
+	TestRig rig(setup, "singleflight", "single_flight_reads 1", 1);
+	CHECK(rig.initialised);
+	FakeMiddleman& middleman = rig.Middleman(0);
+	// slow enough that reads are still in flight when the next are made
+	middleman.SetSlowFraction(1, 300);
+	CHECK(rig.Start());
+	
+	std::atomic<int> done{0};
+	int timeout = 5000;
+	auto submit = [&](const std::string& query){
+		CHECK(rig.client.SubmitQuery("rundb", query, [&done](Query&){ ++done; }, &timeout));
+	};
+	long answered = middleman.QueriesAnswered();
+	long coalesced = rig.client.CoalescedReads();
+	submit("SELECT * FROM run");
+	submit("SELECT * FROM run");
+	submit("SELECT nextval('run_id_seq')");
+	submit("SELECT nextval('run_id_seq')");
+	CHECK(WaitFor([&](){ return done==4; }));
+	CHECK(rig.client.CoalescedReads()-coalesced==1);
+	CHECK(middleman.QueriesAnswered()-answered==3);
+	
+	answered = middleman.QueriesAnswered();
+	coalesced = rig.client.CoalescedReads();
+	submit("SELECT * FROM config");
+	std::string result, err;
+	CHECK(rig.client.SendQuery("rundb", "INSERT INTO config VALUES (1)", &result, &timeout, &err));
+	CHECK(done==4);
+	submit("SELECT * FROM config");
+	submit("SELECT * FROM config");
+	CHECK(WaitFor([&](){ return done==7; }));
+	// the last joins the second, but not the first
+	CHECK(rig.client.CoalescedReads()-coalesced==1);
+	CHECK(middleman.QueriesAnswered()-answered==2);
+}
+
+void TestSubmitWriteNeedsWrite(TestSetup& setup){
+	// fire-and-forget is only for writes; a read's result would have nowhere to go
+	TestRig rig(setup, "submitwrite", "", 0);
+	CHECK(rig.initialised);
+	std::string err;
+	CHECK(not rig.client.SubmitWrite("rundb", "SELECT * FROM run", &err));
+	CHECK(not err.empty());
+	CHECK(rig.client.GetUnwaitedWriteStats().submitted==0);
+}
+
+static long Outstanding(PGClient& client){
+	long outstanding = 0;
+	for(const PeerSelector::PeerStats& peer : client.GetPeerStats()) outstanding += peer.outstanding;
+	return outstanding;
+}
+
+void TestHedgeOutstandingOnResend(TestSetup& setup){
+	// resending a hedged read gives up on the first copy, but the hedged copy is still
+	// outstanding with its middleman until the read completes
+	TestRig rig(setup, "hedgeresend", "read_routing p2c\nhedge_reads 1\nmax_retries 1\nresend_period_ms 100", 2);
+	CHECK(rig.initialised);
+	CHECK(rig.Start());
+	// enough quick reads to know what's slow
+	for(int i=0; i<1100; ++i){
+		std::vector<std::string> results;
+		std::string err;
+		int timeout = 1000;
+		rig.client.SendQuery("rundb", "SELECT * FROM run WHERE id="+std::to_string(i), &results, &timeout, &err);
+	}
+	// then everything is slow, answering long after the read is hedged and resent
+	CHECK(rig.Restart([](FakeMiddleman& middleman){ middleman.SetSlowFraction(1, 1000); }));
+	CHECK(WaitFor([&](){ return Outstanding(rig.client)==0; }));
+	long hedged = rig.client.HedgedReads();
+	long resent = rig.client.ResentQueries();
+	
+	std::atomic<bool> done{false};
+	int timeout = 10000;
+	CHECK(rig.client.SubmitQuery("rundb", "SELECT * FROM run", [&done](Query&){ done = true; }, &timeout));
+	CHECK(WaitFor([&](){ return rig.client.HedgedReads()>hedged && rig.client.ResentQueries()>resent; }, 800));
+	CHECK(not done);
+	CHECK(Outstanding(rig.client)==2);
+	CHECK(WaitFor([&](){ return done.load(); }, 10000));
+	CHECK(Outstanding(rig.client)==0);
+}
+
+void TestWriteTopics(TestSetup& setup){
+	// writes with topics are applied whether the middleman subscribes to all of them or some
+	TestRig rig(setup, "topics", "write_topics 2", 2);
+	CHECK(rig.initialised);
+	FakeMiddleman& all = rig.Middleman(0);
+	FakeMiddleman& one_table = rig.Middleman(1);
+	all.SetWriteTopics(true);
+	one_table.SetWriteTopics(true);
+	one_table.Subscribe(std::string("rundb\0run\0", 10));
+	CHECK(rig.Start("INSERT INTO run VALUES (0)"));
+	long all_applied = all.WritesReceived();
+	long one_table_applied = one_table.WritesReceived();
+	
+	int acknowledged = 0;
+	for(std::string table : {"run", "config", "run"}){
+		std::string result, err;
+		int timeout = 1000;
+		if(rig.client.SendQuery("rundb", "INSERT INTO "+table+" VALUES (1)", &result, &timeout, &err)) ++acknowledged;
+	}
+	CHECK(acknowledged==3);
+	CHECK(WaitFor([&](){ return all.WritesReceived()-all_applied==3 && one_table.WritesReceived()-one_table_applied==2; }));
+}
+
+void TestMetricsSocket(TestSetup& setup){
+	// metrics are served to each requester, including after one has gone before its reply
+	int metrics_port = setup.clt_dlr_port+13;
+	TestRig rig(setup, "metrics", "metrics_port "+std::to_string(metrics_port), 0);
+	CHECK(rig.initialised);
+	std::string endpoint = "tcp://127.0.0.1:"+std::to_string(metrics_port);
+	int linger = 0;
+	int timeout = 1000;
+	for(int i=0; i<3; ++i){
+		zmq::socket_t gone(rig.context, ZMQ_REQ);
+		gone.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+		gone.connect(endpoint);
+		zmq::message_t request(0);
+		gone.send(request);
+	}
+	for(int i=0; i<2; ++i){
+		zmq::socket_t req(rig.context, ZMQ_REQ);
+		req.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+		req.setsockopt(ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+		req.connect(endpoint);
+		zmq::message_t request(0);
+		CHECK(req.send(request));
+		zmq::message_t reply;
+		CHECK(req.recv(&reply));
+		CHECK(std::string(static_cast<char*>(reply.data()), reply.size()).find("pgclient_queries_resent_total")!=std::string::npos);
+	}
+}
+
+static void CopyToFrame(const std::string& data, zmq::message_t& frame){
+	frame.rebuild(data.size());
+	memcpy(frame.data(), data.data(), data.size());
+}
+
+void TestDecompressLimits(TestSetup&){
+	// a compressed frame is restored, but one claiming a size its data couldn't inflate to is
+	// rejected without allocating that much
+	std::string row(100000, 'x');
+	std::string compressed;
+	CHECK(FrameCompression::Compress(row.c_str(), row.size()+1, compressed, 1));
+	zmq::message_t frame;
+	CopyToFrame(compressed, frame);
+	CHECK(FrameCompression::IsCompressed(frame));
+	CHECK(FrameCompression::Decompress(frame));
+	CHECK(frame.size()==row.size()+1 && row==static_cast<char*>(frame.data()));
+	
+	for(uint32_t raw_size : {uint32_t(compressed.size()*FrameCompression::MAX_RATIO+1000), uint32_t(UINT32_MAX)}){
+		CompressedHeader header;
+		memcpy(&header, compressed.data(), sizeof(header));
+		header.raw_size = raw_size;
+		std::string forged = compressed;
+		memcpy(&forged[0], &header, sizeof(header));
+		zmq::message_t forged_frame;
+		CopyToFrame(forged, forged_frame);
+		CHECK(not FrameCompression::Decompress(forged_frame));
+	}
+}
+
+int main(int argc, const char** argv){
+
+	if(argc<2){
+		std::cout<<"usage: "<<argv[0]<<" <configfile>"<<std::endl;
+		return 0;
+	}
+	TestSetup setup;
+	setup.configfile = argv[1];
+	Store config;
+	config.Initialise(setup.configfile);
+	config.Get("clt_dlr_port",setup.clt_dlr_port);
+	config.Get("clt_pub_port",setup.clt_pub_port);
+
+	TestStreamingAcrossMiddlemen(setup);
+	TestReadCacheSchemas(setup);
+	TestLookupKeys(setup);
+	TestDecompressLimits(setup);
+	TestWritesNotResentByDefault(setup);
+	TestHedgesWithoutRetries(setup);
+	TestWriteTopics(setup);
+	TestRoutingWithoutMiddlemen(setup);
+	TestMetricsSocket(setup);
+	TestHedgeOutstandingOnResend(setup);
+	TestSingleFlightReads(setup);
+	TestSubmitWriteNeedsWrite(setup);
+
+	if(failures>0){
+		std::cout<<failures<<" checks failed"<<std::endl;
+		return 1;
+	}
+	std::cout<<"all tests passed"<<std::endl;
+	return 0;
+}
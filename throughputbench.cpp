@@ -0,0 +1,106 @@
+// throughput benchmark for PGClient against a local stand-in middleman.
+// Runs the same load with increasing send/receive batch budgets, showing the gain
+// from draining bursts in one background thread wakeup rather than one query per loop.
+#include "PGClient.h"
+#include "DataModel.h"
+#include "FakeMiddleman.h"
+#include "Store.h"
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+
+double RunBenchmark(std::string configfile, int batch_size, long n_queries, int max_outstanding, int rows){
+
+	// PGClient reads its options from file; append the batch sizes to a copy of the config.
+	std::string tmpconfig = configfile+".throughputbench";
+	{
+		std::ifstream in(configfile);
+		std::ofstream out(tmpconfig);
+		out<<in.rdbuf()<<"\n"
+		   <<"send_batch_size "<<batch_size<<"\n"
+		   <<"receive_batch_size "<<batch_size<<"\n";
+	}
+
+	Store config;
+	config.Initialise(configfile);
+	int clt_dlr_port=77777, clt_pub_port=77778;
+	config.Get("clt_dlr_port",clt_dlr_port);
+	config.Get("clt_pub_port",clt_pub_port);
+
+	PGClient client;
+	if(not client.Initialise(tmpconfig)){
+		std::cerr<<"failed to initialise PGClient"<<std::endl;
+		return -1;
+	}
+
+	zmq::context_t context(1);
+	FakeMiddleman middleman(&context, "127.0.0.1", clt_dlr_port, clt_pub_port);
+	middleman.SetRows(rows, 32);
+	middleman.Start();
+
+	// wait until the middleman has connected and is answering
+	std::vector<std::string> results;
+	std::string err;
+	int timeout = 100;
+	for(int i=0; i<100; ++i){
+		if(client.SendQuery("monitoringdb", "SELECT 1", &results, &timeout, &err)) break;
+	}
+
+	std::atomic<long> outstanding{0};
+	std::atomic<long> failed{0};
+	QueryCallback callback = [&outstanding, &failed](Query& qry){
+		if(not qry.success) ++failed;
+		--outstanding;
+	};
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for(long i=0; i<n_queries; ++i){
+		// keep up to max_outstanding queries in flight at once
+		while(outstanding.load()>=max_outstanding) std::this_thread::yield();
+		++outstanding;
+		if(not client.SubmitQuery("monitoringdb", "SELECT * FROM resources LIMIT 1", callback)){
+			--outstanding;
+			++failed;
+		}
+	}
+	while(outstanding.load()>0) std::this_thread::yield();
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+	client.Finalise();
+	middleman.Stop();
+	remove(tmpconfig.c_str());
+
+	if(failed>0) std::cerr<<failed<<" queries failed with batch size "<<batch_size<<std::endl;
+	double seconds = std::chrono::duration<double>(end-start).count();
+	return n_queries/seconds;
+}
+
+int main(int argc, const char** argv){
+
+	if(argc<2){
+		std::cout<<"usage: "<<argv[0]<<" <configfile> [n_queries=100000] [max_outstanding=1000] [rows=1]"<<std::endl;
+		return 0;
+	}
+	std::string configfile = argv[1];
+	long n_queries = (argc>2) ? std::stol(argv[2]) : 100000;
+	int max_outstanding = (argc>3) ? std::stoi(argv[3]) : 1000;
+	int rows = (argc>4) ? std::stoi(argv[4]) : 1;
+
+	std::vector<int> batch_sizes{1, 8, 64, 256};
+	std::vector<double> rates;
+	for(int batch_size : batch_sizes){
+		rates.push_back(RunBenchmark(configfile, batch_size, n_queries, max_outstanding, rows));
+	}
+
+	std::cout<<"\n"<<n_queries<<" queries, up to "<<max_outstanding<<" outstanding, "<<rows<<" rows per response\n";
+	std::cout<<std::setw(12)<<"batch size"<<std::setw(16)<<"queries/s"<<std::setw(12)<<"speedup"<<std::endl;
+	for(size_t i=0; i<batch_sizes.size(); ++i){
+		std::cout<<std::setw(12)<<batch_sizes.at(i)
+		         <<std::setw(16)<<std::fixed<<std::setprecision(0)<<rates.at(i)
+		         <<std::setw(12)<<std::setprecision(2)<<rates.at(i)/rates.front()<<std::endl;
+	}
+
+	return 0;
+}